@@ -0,0 +1,276 @@
+#ifndef CONCURRENT_TABLE_H_
+#define CONCURRENT_TABLE_H_
+
+#include "util/common.h"
+#include "util/hash.h"
+
+#include "piccolo/table.h"
+#include "piccolo/table-coding.h"
+#include "piccolo/sparse-table.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+namespace piccolo {
+
+// Number of independently locked stripes in a ConcurrentSparseTable.  Enough
+// that threads on a many-core worker rarely contend for the same stripe.
+static const int kConcurrentStripes = 64;
+
+// A local table that several kernel threads may read and update at once.
+// Keys are split across kConcurrentStripes SparseTables by hash, each
+// guarded by its own lock.  Accumulation happens while the stripe is
+// held, so concurrent update()s of one key are applied one at a time.
+//
+// The stripe is picked from bits 32..37 of the key hash: bucket indices
+// use the low bits, the control tag the top 7, and Sharding::Hashed
+// resolves shards from the high end of bits 24..55, so keys that share a
+// shard still spread evenly across stripes.
+//
+// Point operations are thread-safe.  Iterators copy one stripe at a time
+// under its lock and hold no lock between entries, so the caller may use
+// any table meanwhile; changes made through value() are not stored.  A
+// map instead uses lockedRanges(), and copies its results back.  swap()
+// and the marshalling calls are not thread-safe; they are only used
+// between kernels, while the table is quiescent.
+template<class K, class V, class Hasher = Hash<K> >
+class ConcurrentSparseTable: public TableT<K, V>, private boost::noncopyable {
+private:
+  typedef SparseTable<K, V, Hasher> Local;
+
+  struct Stripe {
+    ShardMutex lock;
+    Local* table;
+  };
+
+public:
+  struct Iterator: public TableIteratorT<K, V> {
+    Iterator(ConcurrentSparseTable<K, V, Hasher>& parent) :
+        stripe_(0), end_(kConcurrentStripes), pos_(0), parent_(parent) {
+      fill();
+    }
+
+    // Visit only stripes [begin, end).
+    Iterator(ConcurrentSparseTable<K, V, Hasher>& parent, int begin, int end) :
+        stripe_(begin), end_(end), pos_(0), parent_(parent) {
+      fill();
+    }
+
+    void Next() {
+      ++pos_;
+      fill();
+    }
+
+    bool done() {
+      return pos_ == keys_.size();
+    }
+
+    const K& key() {
+      return keys_[pos_];
+    }
+    V& value() {
+      return values_[pos_];
+    }
+
+  private:
+    // Copy the next stripe with entries once the current one is used up.
+    void fill() {
+      while (pos_ == keys_.size() && stripe_ < end_) {
+        keys_.clear();
+        values_.clear();
+        pos_ = 0;
+
+        Stripe& s = parent_.stripes_[stripe_++];
+        ShardLock sl(&s.lock);
+        for (typename Local::Iterator it(*s.table); !it.done(); it.Next()) {
+          keys_.push_back(it.key());
+          values_.push_back(it.value());
+        }
+      }
+    }
+
+    int stripe_;
+    int end_;
+    size_t pos_;
+    std::vector<K> keys_;
+    std::vector<V> values_;
+    ConcurrentSparseTable<K, V, Hasher> &parent_;
+  };
+
+  static const bool kThreadSafe = true;
+
+  static Table* create(int numShards, Accumulator<V>* accum) {
+    return new ConcurrentSparseTable(1, accum);
+  }
+
+  ConcurrentSparseTable(int size = 1, Accumulator<V>* accum = NULL) {
+    for (int i = 0; i < kConcurrentStripes; ++i) {
+      stripes_[i].table = new Local(1 + size / kConcurrentStripes, accum);
+    }
+  }
+
+  ~ConcurrentSparseTable() {
+    for (int i = 0; i < kConcurrentStripes; ++i) {
+      delete stripes_[i].table;
+    }
+  }
+
+  V get(const K& k) {
+    Stripe& s = stripe(k);
+    ShardLock sl(&s.lock);
+    return s.table->get(k);
+  }
+
+  bool contains(const K& k) {
+    Stripe& s = stripe(k);
+    ShardLock sl(&s.lock);
+    return s.table->contains(k);
+  }
+
+  void put(const K& k, const V& v) {
+    Stripe& s = stripe(k);
+    ShardLock sl(&s.lock, true);
+    s.table->put(k, v);
+  }
+
+  void update(const K& k, const V& v) {
+    Stripe& s = stripe(k);
+    ShardLock sl(&s.lock, true);
+    s.table->update(k, v);
+  }
+
+  void remove(const K& k) {
+    Stripe& s = stripe(k);
+    ShardLock sl(&s.lock, true);
+    s.table->remove(k);
+  }
+
+  int32_t id() {return -1;}
+  int32_t numShards() {return 1;}
+
+  bool empty() {return size() == 0;}
+
+  int64_t size() {
+    int64_t total = 0;
+    for (int i = 0; i < kConcurrentStripes; ++i) {
+      ShardLock sl(&stripes_[i].lock);
+      total += stripes_[i].table->size();
+    }
+    return total;
+  }
+
+  void clear() {
+    for (int i = 0; i < kConcurrentStripes; ++i) {
+      ShardLock sl(&stripes_[i].lock, true);
+      stripes_[i].table->clear();
+    }
+  }
+
+  void reserve(int64_t new_size) {
+    for (int i = 0; i < kConcurrentStripes; ++i) {
+      ShardLock sl(&stripes_[i].lock, true);
+      stripes_[i].table->reserve(1 + new_size / kConcurrentStripes);
+    }
+  }
+
+  void swap(Table* t) {
+    ConcurrentSparseTable<K, V, Hasher>* o =
+        static_cast<ConcurrentSparseTable<K, V, Hasher>*>(t);
+    for (int i = 0; i < kConcurrentStripes; ++i) {
+      std::swap(stripes_[i].table, o->stripes_[i].table);
+    }
+  }
+
+  TableIterator *get_iterator() {
+    return new Iterator(*this);
+  }
+
+  TableIteratorT<K, V>* typedIterator() {
+    return new Iterator(*this);
+  }
+
+  void typedIterators(int count, std::vector<TableIteratorT<K, V>*>* out) {
+    CHECK_GT(count, 0);
+    int step = (kConcurrentStripes + count - 1) / count;
+    for (int begin = 0; begin < kConcurrentStripes; begin += step) {
+      out->push_back(new Iterator(*this, begin,
+          std::min(begin + step, kConcurrentStripes)));
+    }
+  }
+
+  // One range per stripe, under the stripe's lock; a map copies values in
+  // and out of the stripes directly.  The shard has no lock of its own.
+  void lockedRanges(ShardMutex* lock, int count,
+      std::vector<typename TableT<K, V>::LockedRange>* out) {
+    for (int i = 0; i < kConcurrentStripes; ++i) {
+      Stripe& s = stripes_[i];
+      s.lock.beginMap();
+      ShardLock sl(&s.lock);
+      typename TableT<K, V>::LockedRange r =
+          { &s.lock, new typename Local::Iterator(*s.table) };
+      out->push_back(r);
+    }
+  }
+
+  // Untyped operations
+  bool containsStr(const StringPiece& k) {
+    return contains(unmarshal<K>(k));
+  }
+
+  string getStr(const StringPiece &k) {
+    return marshal(get(unmarshal<K>(k)));
+  }
+
+  void putStr(const StringPiece &k, const StringPiece &v) {
+    put(unmarshal<K>(k), unmarshal<V>(v));
+  }
+
+  void updateStr(const StringPiece &k, const StringPiece &v) {
+    update(unmarshal<K>(k), unmarshal<V>(v));
+  }
+
+  TableIterator* iterator() {
+    return get_iterator();
+  }
+
+  void write(TableCoder *out) {
+    for (int i = 0; i < kConcurrentStripes; ++i) {
+      stripes_[i].table->write(out);
+    }
+  }
+
+  int64_t read(TableCoder *in) {
+    string k, v;
+    int64_t updates = ApplyBulk<K, V>(in, this);
+    while (in->read(&k, &v)) {
+      updateStr(k, v);
+      updates++;
+    }
+    return updates;
+  }
+
+  void applyUpdates(TableCoder *in) {
+    ApplyBulk<K, V>(in, this);
+
+    K k;
+    V v;
+    string kt, vt;
+
+    while (in->read(&kt, &vt)) {
+      unmarshal(kt, &k);
+      unmarshal(vt, &v);
+      update(k, v);
+    }
+  }
+
+private:
+  Stripe& stripe(const K& k) {
+    return stripes_[(Hasher()(k) >> 32) & (kConcurrentStripes - 1)];
+  }
+
+  Stripe stripes_[kConcurrentStripes];
+};
+
+} /* namespace piccolo */
+
+#endif /* CONCURRENT_TABLE_H_ */
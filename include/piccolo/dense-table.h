@@ -0,0 +1,274 @@
+#ifndef DENSE_TABLE_H_
+#define DENSE_TABLE_H_
+
+#include "util/common.h"
+#include "util/memory.h"
+
+#include "piccolo/table.h"
+#include "piccolo/table-coding.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/type_traits.hpp>
+
+#include <vector>
+
+namespace piccolo {
+
+// A table for dense, non-negative integer keys.  Keys map to slots
+// arithmetically and a presence bitmap records which slots hold a value, so
+// lookups do no hashing or probing and iteration is sequential.
+//
+// Each DenseTable holds one shard of a table sharded with Sharding::Mod or
+// Sharding::UintMod: all of its keys share the same residue modulo the
+// shard count ('stride'), and key k lives in slot k / stride.
+template<class K, class V>
+class DenseTable: public TableT<K, V>, private boost::noncopyable {
+  static_assert(boost::is_integral<K>::value,
+      "DenseTable keys must be integers.");
+public:
+  struct Iterator: public TableIteratorT<K, V> {
+    Iterator(DenseTable<K, V>& parent) :
+        pos(-1), end_(parent.slots()), parent_(parent) {
+      Next();
+    }
+
+    // Visit only slots [begin, end).
+    Iterator(DenseTable<K, V>& parent, int64_t begin, int64_t end) :
+        pos(begin - 1), end_(end), parent_(parent) {
+      Next();
+    }
+
+    void Next() {
+      pos = parent_.next_present(pos + 1);
+      if (!done()) {
+        key_ = parent_.key_for_slot(pos);
+      }
+    }
+
+    // The table may have shrunk (by swap()) since a remote iterator's
+    // last page.
+    bool done() {
+      return pos >= end_ || pos >= parent_.slots();
+    }
+
+    const K& key() {
+      return key_;
+    }
+    V& value() {
+      return parent_.values_[pos].get();
+    }
+
+    int64_t pos;
+    int64_t end_;
+    K key_;
+    DenseTable<K, V> &parent_;
+  };
+
+  static const bool kThreadSafe = false;
+
+  static Table* create(int numShards, Accumulator<V>* accum) {
+    return new DenseTable(numShards, accum);
+  }
+
+  DenseTable(int stride = 1, Accumulator<V>* accum = NULL) :
+      entries_(0), stride_(stride), offset_(-1), accum_(accum) {
+    CHECK_GT(stride, 0);
+  }
+
+  V get(const K& k) {
+    int64_t s = slot_for_key(k);
+    CHECK(s != -1 && is_present(s))<< "No entry for requested key";
+    return values_[s].get();
+  }
+
+  bool contains(const K& k) {
+    int64_t s = slot_for_key(k);
+    return s != -1 && is_present(s);
+  }
+
+  void put(const K& k, const V& v) {
+    int64_t s = slot_for_key(k);
+    if (s != -1 && is_present(s)) {
+      values_[s].get() = v;
+    } else {
+      values_[claim_slot(k)].store(&arena_, v);
+    }
+  }
+
+  void update(const K& k, const V& v) {
+    int64_t s = slot_for_key(k);
+    if (s != -1 && is_present(s)) {
+      accum_->Accumulate(&values_[s].get(), v);
+    } else {
+      put(k, v);
+    }
+  }
+
+  void remove(const K& k) {
+    int64_t s = slot_for_key(k);
+    if (s != -1 && is_present(s)) {
+      values_[s].release(&arena_);
+      present_[s >> 6] &= ~(1ULL << (s & 63));
+      --entries_;
+    }
+  }
+
+  int32_t id() {return -1;}
+  int32_t numShards() {return 1;}
+
+  bool empty() {return size() == 0;}
+  int64_t size() {return entries_;}
+  int64_t capacity() {return slots();}
+
+  void clear() {
+    std::fill(present_.begin(), present_.end(), 0);
+    entries_ = 0;
+    arena_.reset();
+  }
+
+  // Dense keys fill their slots, so the expected entry count is also the
+  // number of slots to allocate.
+  void reserve(int64_t new_size) {
+    if (new_size > slots()) {
+      resize(new_size);
+    }
+  }
+
+  void resize(int64_t slots) {
+    values_.resize(slots);
+    present_.resize((slots + 63) / 64, 0);
+  }
+
+  void swap(Table* t) {
+    DenseTable<K, V>* o = static_cast<DenseTable<K, V>*>(t);
+    values_.swap(o->values_);
+    present_.swap(o->present_);
+    std::swap(entries_, o->entries_);
+    std::swap(offset_, o->offset_);
+    arena_.swap(o->arena_);
+  }
+
+  TableIterator *get_iterator() {
+    return new Iterator(*this);
+  }
+
+  TableIteratorT<K, V>* typedIterator() {
+    return new Iterator(*this);
+  }
+
+  // Ranges are whole words of the presence bitmap.
+  void typedIterators(int count, std::vector<TableIteratorT<K, V>*>* out) {
+    CHECK_GT(count, 0);
+    int64_t step = ((slots() + count - 1) / count + 63) & ~int64_t(63);
+    for (int64_t begin = 0; begin < slots(); begin += step) {
+      out->push_back(new Iterator(*this, begin, std::min(begin + step, slots())));
+    }
+    if (out->empty()) {
+      out->push_back(new Iterator(*this));
+    }
+  }
+
+  // Untyped operations
+  bool containsStr(const StringPiece& k) {
+    return contains(unmarshal<K>(k));
+  }
+
+  string getStr(const StringPiece &k) {
+    return marshal(get(unmarshal<K>(k)));
+  }
+
+  void putStr(const StringPiece &k, const StringPiece &v) {
+    put(unmarshal<K>(k), unmarshal<V>(v));
+  }
+
+  void updateStr(const StringPiece &k, const StringPiece &v) {
+    update(unmarshal<K>(k), unmarshal<V>(v));
+  }
+
+  TableIterator* iterator() {
+    return get_iterator();
+  }
+
+  void applyUpdates(TableCoder *in) {
+    ApplyBulk<K, V>(in, this);
+
+    string k, v;
+    while (in->read(&k, &v)) {
+      updateStr(k, v);
+    }
+  }
+
+private:
+  int64_t slots() const {
+    return values_.size();
+  }
+
+  bool is_present(int64_t s) const {
+    return s < slots() && (present_[s >> 6] & (1ULL << (s & 63)));
+  }
+
+  // Return the slot for 'k', or -1 if 'k' cannot belong to this shard.
+  int64_t slot_for_key(const K& k) const {
+    if (k < 0 || (offset_ != -1 && int64_t(k % stride_) != offset_)) {
+      return -1;
+    }
+    return k / stride_;
+  }
+
+  K key_for_slot(int64_t s) const {
+    return K(s * stride_ + offset_);
+  }
+
+  // Return the slot for 'k', growing the table and marking it present.  The
+  // caller stores the value.
+  int64_t claim_slot(const K& k) {
+    CHECK_GE(k, 0)<< "DenseTable keys must be non-negative.";
+    if (offset_ == -1) {
+      offset_ = k % stride_;
+    }
+    CHECK_EQ(int64_t(k % stride_), offset_)
+        << "DenseTable keys must share a residue modulo the shard count.";
+
+    int64_t s = k / stride_;
+    if (s >= slots()) {
+      resize(std::max(s + 1, 2 * slots()));
+    }
+    if (!is_present(s)) {
+      present_[s >> 6] |= 1ULL << (s & 63);
+      ++entries_;
+    }
+    return s;
+  }
+
+  // Return the first present slot at or after 's', or slots() if none.
+  int64_t next_present(int64_t s) const {
+    int64_t w = s >> 6;
+    if (w >= (int64_t) present_.size()) {
+      return slots();
+    }
+
+    uint64_t bits = present_[w] & (~0ULL << (s & 63));
+    while (bits == 0) {
+      if (++w == (int64_t) present_.size()) {
+        return slots();
+      }
+      bits = present_[w];
+    }
+    return (w << 6) + __builtin_ctzll(bits);
+  }
+
+  // Growing copies only the slots; non-POD values stay put in arena_.
+  std::vector<ValueSlot<V> > values_;
+  std::vector<uint64_t> present_;
+  Arena<V> arena_;
+
+  int64_t entries_;
+  int64_t stride_;
+  int64_t offset_;
+
+  Accumulator<V>* accum_;
+};
+
+} /* namespace piccolo */
+
+#endif /* DENSE_TABLE_H_ */
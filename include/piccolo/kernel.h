@@ -4,9 +4,16 @@
 #include "piccolo/table.h"
 #include "util/common.h"
 
+#include <boost/bind.hpp>
 #include <boost/smart_ptr.hpp>
 #include <boost/function.hpp>
+#include <boost/thread.hpp>
 #include <map>
+#include <set>
+#include <vector>
+
+DECLARE_int32(map_threads);
+DECLARE_int64(map_split_entries);
 
 namespace piccolo {
 
@@ -25,6 +32,10 @@ public:
     return dynamic_cast<TableT<K, V>*>(table(id));
   }
 
+  virtual ~Kernel() {}
+
+  // Called once for each shard the kernel runs on.  Classes used with
+  // TableT::runKernel() provide their own per-shard methods instead.
   virtual void run(ShardedTable* table, int shard);
 
 private:
@@ -40,44 +51,234 @@ class KernelRegistry {
 public:
   typedef std::map<int, KernelMaker*> Map;
   static int add(KernelMaker* k) {
-    int id = kernels.size();
-    kernels[id] = k;
+    int id = kernels().size();
+    kernels()[id] = k;
     return id;
   }
 
   static Kernel* create(int id) {
-    return kernels[id]->create();
+    return kernels()[id]->create();
+  }
+
+  // Kernels register themselves from static initializers in other
+  // translation units, so the map is built on first use.
+  static Map& kernels() {
+    static Map m;
+    return m;
+  }
+};
+
+// Run kernel 'kernelId' on every shard of 'table' and wait for it to
+// finish.  Defined in master.cc.
+void RunKernelOnShards(Table* table, int kernelId);
+
+// Registers KernelType and gives it an id.  Every process runs the same
+// binary, so ids agree between the master and the workers.
+template<class KernelType>
+struct KernelRegister: public KernelMaker {
+public:
+  static int id;
+  Kernel* create() {
+    return new KernelType();
   }
+};
+
+template<class KernelType>
+int KernelRegister<KernelType>::id = KernelRegistry::add(
+    new KernelRegister<KernelType>);
+
+// The stages of a map: a static apply(key, value) that calls each map
+// function in turn.
+template<class K, class V>
+struct MapNone {
+  static void apply(const K& k, V& v) {}
+};
 
-  static Map kernels;
+template<class K, class V, class Prev, void (*MapFunction)(const K&, V&)>
+struct MapStage {
+  static void apply(const K& k, V& v) {
+    Prev::apply(k, v);
+    MapFunction(k, v);
+  }
 };
 
-template<class K, class V, void(*MapFunction)(const K&, V&)>
+// Number of entries a map copies out of a locked shard at a time.
+static const size_t kMapBatch = 256;
+
+// Calls Stages::apply on each entry of a local shard, and stores the
+// values it leaves back into the shard.
+//
+// The shard is mapped a batch of values at a time: the values are copied
+// out under the lock guarding them, the map functions run on the copies
+// without it, and the results are copied back under it.  Gets and
+// iterators, local or remote, read the shard between batches, so map
+// functions may read any table.  Writers wait for the map to finish, since
+// they could move entries the map holds (see ShardMutex).  A thread-safe
+// table is mapped a stripe at a time under the stripe locks.
+//
+// A shard of at least --map_split_entries entries is mapped by up to
+// --map_threads threads, each taking its share of the ranges the table
+// splits into.  Each thread's update()s to sharded tables are buffered and
+// applied once the map is done, and map functions must not put() to or
+// remove() from the table being mapped.
+template<class K, class V, class Stages>
 class MapKernel: public Kernel {
 public:
   typedef TableIteratorT<K, V> Iter;
+  typedef typename TableT<K, V>::LockedRange Range;
+
+  void run(ShardedTable* table, int shard) {
+    TableT<K, V>* t = static_cast<TableT<K, V>*>(table->shard(shard));
+    int count = 1;
+    if (FLAGS_map_threads > 1 && t->size() >= FLAGS_map_split_entries) {
+      count = FLAGS_map_threads;
+    }
+
+    std::vector<Range> ranges;
+    t->lockedRanges(table->shardLock(shard), count, &ranges);
+    count = std::min<int>(count, ranges.size());
+
+    std::vector<UpdateBuffers*> buffers;
+    boost::thread_group threads;
+    for (int i = 0; i < count; ++i) {
+      buffers.push_back(new UpdateBuffers(table));
+      if (i > 0) {
+        threads.create_thread(
+            boost::bind(&mapRanges, &ranges, i, count, buffers[i]));
+      }
+    }
+    mapRanges(&ranges, 0, count, buffers[0]);
+    threads.join_all();
+
+    std::set<ShardMutex*> locks;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      delete ranges[i].iter;
+      locks.insert(ranges[i].lock);
+    }
+    for (std::set<ShardMutex*>::iterator i = locks.begin(); i != locks.end();
+        ++i) {
+      (*i)->endMap();
+    }
 
-  void run(TableT<K, V> *t) {
-    Iter* iter = t->typedIterator();
-    for (; !iter->done(); iter->Next()) {
-      MapFunction(iter->key(), iter->value());
+    // The buffered updates may go to the mapped shard itself.
+    for (size_t i = 0; i < buffers.size(); ++i) {
+      buffers[i]->flush();
+      delete buffers[i];
+    }
+  }
+
+private:
+  // Map every 'step'th range, starting at 'first'.
+  static void mapRanges(std::vector<Range>* ranges, int first, int step,
+      UpdateBuffers* buffers) {
+    UpdateBuffers::setCurrent(buffers);
+    for (size_t i = first; i < ranges->size(); i += step) {
+      mapBatches((*ranges)[i].iter, (*ranges)[i].lock);
+    }
+    UpdateBuffers::setCurrent(NULL);
+  }
+
+  // No writer can move the entries while the map runs, so the value slots
+  // found under the lock are still valid when the results are stored.
+  static void mapBatches(Iter* iter, ShardMutex* lock) {
+    std::vector<K> keys;
+    std::vector<V> values;
+    std::vector<V*> slots;
+    while (true) {
+      keys.clear();
+      values.clear();
+      slots.clear();
+      {
+        ShardLock sl(lock);
+        for (; !iter->done() && keys.size() < kMapBatch; iter->Next()) {
+          keys.push_back(iter->key());
+          values.push_back(iter->value());
+          slots.push_back(&iter->value());
+        }
+      }
+      if (keys.empty()) {
+        return;
+      }
+
+      for (size_t i = 0; i < keys.size(); ++i) {
+        Stages::apply(keys[i], values[i]);
+      }
+
+      ShardLock sl(lock);
+      for (size_t i = 0; i < slots.size(); ++i) {
+        std::swap(*slots[i], values[i]);
+      }
     }
-    delete iter;
   }
 };
 
-template<class K, class V, void(*MapFunction)(const K&, V&)>
-struct MapKernelRegister: public KernelMaker {
+template<class K, class V, void (*RunFunction)(TableT<K, V>*, int)>
+class FunctionKernel: public Kernel {
 public:
-  static int id;
-  Kernel* create() {
-    return new MapKernel<K, V, MapFunction>();
+  void run(ShardedTable* table, int shard) {
+    RunFunction(dynamic_cast<TableT<K, V>*>(table), shard);
   }
 };
 
-template<class K, class V, void(*MapFunction)(const K&, V&)>
-int MapKernelRegister<K, V, MapFunction>::id = KernelRegistry::add(
-    new MapKernelRegister<K, V, MapFunction>);
+template<class K, class V, class KernelClass,
+    void (KernelClass::*Method)(TableT<K, V>*, int)>
+class MethodKernel: public Kernel {
+public:
+  void run(ShardedTable* table, int shard) {
+    (instance_.*Method)(dynamic_cast<TableT<K, V>*>(table), shard);
+  }
+
+private:
+  KernelClass instance_;
+};
+
+// Built by TableT::pipeline().  Each stage sees the value left by the
+// stages before it, but, as within a single map, updates made to other
+// entries and tables are only certain to be visible once run() returns.
+template<class K, class V, class Stages>
+class MapPipeline {
+public:
+  explicit MapPipeline(TableT<K, V>* table) :
+      table_(table) {
+  }
+
+  template<void (*MapFunction)(const K&, V&)>
+  MapPipeline<K, V, MapStage<K, V, Stages, MapFunction> > map() const {
+    return MapPipeline<K, V, MapStage<K, V, Stages, MapFunction> >(table_);
+  }
+
+  void run() const {
+    RunKernelOnShards(table_, KernelRegister<MapKernel<K, V, Stages> >::id);
+  }
+
+private:
+  TableT<K, V>* table_;
+};
+
+template<class K, class V>
+template<void (*MapFunction)(const K&, V&)>
+void TableT<K, V>::map() {
+  pipeline().template map<MapFunction>().run();
+}
+
+template<class K, class V>
+MapPipeline<K, V, MapNone<K, V> > TableT<K, V>::pipeline() {
+  return MapPipeline<K, V, MapNone<K, V> >(this);
+}
+
+template<class K, class V>
+template<void (*RunFunction)(TableT<K, V>*, int)>
+void TableT<K, V>::run() {
+  RunKernelOnShards(this,
+      KernelRegister<FunctionKernel<K, V, RunFunction> >::id);
+}
+
+template<class K, class V>
+template<class KernelClass, void (KernelClass::*Method)(TableT<K, V>*, int)>
+void TableT<K, V>::runKernel() {
+  RunKernelOnShards(this,
+      KernelRegister<MethodKernel<K, V, KernelClass, Method> >::id);
+}
 
 } // namespace piccolo
 
@@ -2,62 +2,378 @@
 #define SPARSE_MAP_H_
 
 #include "util/common.h"
+#include "util/hash.h"
+#include "util/memory.h"
 
 #include "piccolo.pb.h"
 #include "piccolo/table.h"
+#include "piccolo/table-coding.h"
 
 #include <boost/noncopyable.hpp>
-#include <boost/dynamic_bitset.hpp>
+
+#include <limits>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+DECLARE_int64(sparse_table_incremental_resize);
 
 namespace piccolo {
 
-static const double kLoadFactor = 0.4;
+// Robin Hood insertion keeps probe sequences short enough to run tables
+// this full.
+static const double kLoadFactor = 0.8;
+
+// Control bytes for SparseTable buckets.  A free bucket is marked with the
+// high bit set; an occupied bucket stores the low 7 bits of the top of its
+// key hash, so most probes are resolved without touching keys at all.
+static const uint8_t kCtrlEmpty = 0x80;
+static const int kGroupWidth = 16;
+
+// Control bytes are grouped into chunks of up to 64 buckets, each stamped
+// with the epoch in which it was last written.  clear() just advances the
+// table epoch; a stale chunk reads as empty and is reset on its next write.
+static const int kChunkShift = 6;
+
+// Number of old buckets examined per write while a table is being resized
+// incrementally.  Any value of 2 or more finishes migration before the new
+// array fills up.  Lookups leave the buckets where they are, so readers can
+// share a shard with a map that holds pointers into it (see MapKernel).
+static const int kResizeStep = 64;
+
+// Number of keys hashed and prefetched ahead of resolution by the batched
+// operations; enough to cover memory latency without evicting the batch.
+static const int kPrefetchBatch = 16;
+
+// Bitmask of matching positions within a group of control bytes.
+struct GroupMask {
+  uint32_t mask;
+
+  explicit GroupMask(uint32_t m) :
+      mask(m) {
+  }
+
+  operator bool() const {
+    return mask != 0;
+  }
+
+  int lowest() const {
+    return __builtin_ctz(mask);
+  }
+
+  void next() {
+    mask &= mask - 1;
+  }
+};
+
+// A window of kGroupWidth consecutive control bytes, compared in parallel.
+struct CtrlGroup {
+#if defined(__SSE2__)
+  __m128i ctrl;
+
+  explicit CtrlGroup(const uint8_t* p) :
+      ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))) {
+  }
+
+  GroupMask match(uint8_t tag) const {
+    return GroupMask(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(tag))));
+  }
+
+  GroupMask matchEmpty() const {
+    return GroupMask(_mm_movemask_epi8(ctrl));
+  }
+
+  GroupMask matchFull() const {
+    return GroupMask(~_mm_movemask_epi8(ctrl) & 0xffff);
+  }
+#else
+  const uint8_t* ctrl;
+
+  explicit CtrlGroup(const uint8_t* p) :
+      ctrl(p) {
+  }
+
+  GroupMask match(uint8_t tag) const {
+    uint32_t m = 0;
+    for (int i = 0; i < kGroupWidth; ++i) {
+      m |= uint32_t(ctrl[i] == tag) << i;
+    }
+    return GroupMask(m);
+  }
+
+  GroupMask matchEmpty() const {
+    uint32_t m = 0;
+    for (int i = 0; i < kGroupWidth; ++i) {
+      m |= uint32_t(ctrl[i] >> 7) << i;
+    }
+    return GroupMask(m);
+  }
 
-template<class K, class V>
+  GroupMask matchFull() const {
+    return GroupMask(~matchEmpty().mask & ((1 << kGroupWidth) - 1));
+  }
+#endif
+};
+
+// Reaches into a SparseTable's internals for the tests in table.cc.
+struct SparseTableTest;
+
+// Hasher is a policy from util/hash.h (or compatible): it must return a
+// fully mixed 64-bit hash.
+template<class K, class V, class Hasher = Hash<K> >
 class SparseTable: public TableT<K, V>, private boost::noncopyable {
 private:
-#pragma pack(push, 1)
+  // Values that are not POD live in the table's arena; see ValueSlot.
   struct Bucket {
     K k;
-    V v;
-    bool in_use;
+    ValueSlot<V> v;
+  };
+
+  // An open-addressed array of buckets and their control bytes.  A table
+  // normally has exactly one of these; while it grows incrementally the old
+  // array is kept alongside the new one and drained a few buckets at a time.
+  //
+  // Large arrays are mmap'd and backed by huge pages where possible (see
+  // util/memory.h), since random probes into them would otherwise also pay
+  // a TLB miss.
+  struct Storage {
+    LargeArray<Bucket> buckets;
+    LargeArray<uint8_t> ctrl;
+    std::vector<uint32_t> chunk_epoch;
+
+    int64_t size;
+    int64_t mask;
+    int64_t entries;
+    int chunk_shift;
+    uint32_t epoch;
+
+    Storage() :
+        size(0), mask(0), entries(0), chunk_shift(0), epoch(0) {
+    }
+
+    void allocate(int64_t capacity) {
+      buckets.allocate(capacity);
+      ctrl.allocate(capacity + kGroupWidth);
+      size = capacity;
+      mask = capacity - 1;
+
+      chunk_shift = 0;
+      while (chunk_shift < kChunkShift && (1 << (chunk_shift + 1)) <= size) {
+        ++chunk_shift;
+      }
+      chunk_epoch.assign(size >> chunk_shift, 0);
+      epoch = 0;
+      clear();
+    }
+
+    void release() {
+      buckets.release();
+      ctrl.release();
+      std::vector<uint32_t>().swap(chunk_epoch);
+      size = mask = entries = 0;
+    }
+
+    void clear() {
+      entries = 0;
+      if (++epoch == 0) {
+        // The epoch wrapped; fall back to sweeping the control bytes once.
+        memset(&ctrl[0], kCtrlEmpty, ctrl.size());
+        std::fill(chunk_epoch.begin(), chunk_epoch.end(), 0);
+      }
+    }
+
+    void swap(Storage& o) {
+      buckets.swap(o.buckets);
+      ctrl.swap(o.ctrl);
+      chunk_epoch.swap(o.chunk_epoch);
+      std::swap(size, o.size);
+      std::swap(mask, o.mask);
+      std::swap(entries, o.entries);
+      std::swap(chunk_shift, o.chunk_shift);
+      std::swap(epoch, o.epoch);
+    }
+
+    bool is_live_chunk(int64_t b) const {
+      return chunk_epoch[b >> chunk_shift] == epoch;
+    }
+
+    bool is_full(int64_t b) const {
+      return is_live_chunk(b) && !(ctrl[b] & kCtrlEmpty);
+    }
+
+    // Reset the chunk holding bucket 'b' if it predates the last clear().
+    void refresh(int64_t b) {
+      int64_t c = b >> chunk_shift;
+      if (chunk_epoch[c] != epoch) {
+        memset(&ctrl[c << chunk_shift], kCtrlEmpty, 1 << chunk_shift);
+        if (c == 0) {
+          memset(&ctrl[size], kCtrlEmpty, kGroupWidth);
+        }
+        chunk_epoch[c] = epoch;
+      }
+    }
+
+    // The control bytes for the probe window starting at 'pos'.
+    const uint8_t* window(int64_t pos) {
+      refresh(pos);
+      refresh((pos + kGroupWidth - 1) & mask);
+      return &ctrl[pos];
+    }
+
+    void set_ctrl(int64_t b, uint8_t c) {
+      refresh(b);
+      ctrl[b] = c;
+      // The first group is mirrored past the end of the table so a probe
+      // window starting anywhere can be loaded without wrapping.
+      if (b < kGroupWidth) {
+        ctrl[size + b] = c;
+      }
+    }
+
+    // Distance of the entry in bucket 'b' from its home bucket.
+    int64_t displacement(int64_t b) {
+      return (b - (hash(buckets[b].k) & mask)) & mask;
+    }
+
+    // Return the bucket holding 'k', or -1 if it is not present.
+    int64_t find(const K& k, uint64_t h) {
+      const uint8_t tag = tag_for_hash(h);
+      int64_t pos = h & mask;
+
+      while (true) {
+        CtrlGroup g(window(pos));
+        for (GroupMask m = g.match(tag); m; m.next()) {
+          int64_t b = (pos + m.lowest()) & mask;
+          if (buckets[b].k == k) {
+            return b;
+          }
+        }
+
+        // Clusters never contain holes (see erase()), so the key cannot
+        // live beyond the first empty slot of the probe sequence.
+        if (g.matchEmpty()) {
+          return -1;
+        }
+
+        pos = (pos + kGroupWidth) & mask;
+      }
+    }
+
+    // Return the first free bucket at or after 'pos'.
+    int64_t free_bucket(int64_t pos) {
+      while (true) {
+        GroupMask m = CtrlGroup(window(pos)).matchEmpty();
+        if (m) {
+          return (pos + m.lowest()) & mask;
+        }
+        pos = (pos + kGroupWidth) & mask;
+      }
+    }
+
+    // Insert a key known not to be present and return its bucket; the
+    // caller ensures there is room and fills in the value.
+    int64_t insert(const K& k, uint64_t h);
+    void erase(int64_t b);
   };
-#pragma pack(pop)
 
 public:
   struct Iterator: public TableIteratorT<K, V> {
-    Iterator(SparseTable<K, V>& parent) :
-        pos(-1), parent_(parent) {
+    Iterator(SparseTable<K, V, Hasher>& parent) :
+        pos(-1), end_(parent.cur_.size), s_(&parent.cur_), parent_(parent) {
       Next();
     }
 
+    // Visit only buckets [begin, end) of the current array; see ranges().
+    Iterator(SparseTable<K, V, Hasher>& parent, int64_t begin, int64_t end) :
+        pos(begin - 1), end_(end), s_(&parent.cur_), parent_(parent) {
+      Next();
+    }
+
+    // Walks the current bucket array, then the one being drained if a
+    // resize is in progress.  Occupied buckets are found a group of control
+    // bytes at a time, so a scan costs one load per 16 buckets plus one
+    // step per entry.  Chunks untouched since the last clear() are skipped
+    // whole.
+    //
+    // An iterator kept across writes to the table (as remote iterators are,
+    // between pages) may skip or repeat entries, but never reads past the
+    // arrays it walks, even if they have since shrunk or been released.
     void Next() {
-      do {
-        ++pos;
-      } while (pos < parent_.size_ && !parent_.buckets_[pos].in_use);
+      ++pos;
+      while (s_ != NULL) {
+        end_ = std::min(end_, s_->size);
+        while (pos < end_) {
+          if (!s_->is_live_chunk(pos)) {
+            pos = ((pos >> s_->chunk_shift) + 1) << s_->chunk_shift;
+            continue;
+          }
+
+          // Chunks are at least a group wide, so an aligned group never
+          // straddles a stale chunk.
+          int64_t base = pos & ~int64_t(kGroupWidth - 1);
+          GroupMask m = CtrlGroup(&s_->ctrl[base]).matchFull();
+          m.mask &= ~0U << (pos - base);
+          if (m) {
+            pos = base + m.lowest();
+            if (pos < end_) {
+              return;
+            }
+            break;
+          }
+          pos = base + kGroupWidth;
+        }
+
+        // Only the iterator covering the end of the current array goes on
+        // to the old one.
+        bool next_old = s_ == &parent_.cur_ && end_ == s_->size &&
+            parent_.resizing();
+        s_ = next_old ? &parent_.old_ : NULL;
+        pos = 0;
+        end_ = next_old ? s_->size : 0;
+      }
     }
 
     bool done() {
-      return pos == parent_.size_;
+      return s_ == NULL;
     }
 
     const K& key() {
-      return parent_.buckets_[pos].k;
+      return s_->buckets[pos].k;
     }
     V& value() {
-      return parent_.buckets_[pos].v;
+      return s_->buckets[pos].v.get();
     }
 
-    int pos;
-    SparseTable<K, V> &parent_;
+    int64_t pos;
+    int64_t end_;
+    Storage* s_;
+    SparseTable<K, V, Hasher> &parent_;
   };
 
-  static Table* create() {
-    return new SparseTable;
+  // Split the bucket array into at most 'count' contiguous ranges, each
+  // returned as an iterator.  Together they visit every entry exactly once,
+  // so a scan can be divided between threads.  The caller owns the
+  // iterators.
+  void ranges(int count, std::vector<Iterator*>* out) {
+    CHECK_GT(count, 0);
+    int64_t step = (cur_.size + count - 1) / count;
+    step = (step + kGroupWidth - 1) & ~int64_t(kGroupWidth - 1);
+    for (int64_t begin = 0; begin < cur_.size; begin += step) {
+      out->push_back(new Iterator(*this, begin, std::min(begin + step, cur_.size)));
+    }
+  }
+
+  static const bool kThreadSafe = false;
+
+  static Table* create(int numShards, Accumulator<V>* accum) {
+    return new SparseTable(1, accum);
   }
 
   // Construct a SparseTable with the given initial size; it will be expanded as necessary.
-  SparseTable(int size = 1);
+  SparseTable(int size = 1, Accumulator<V>* accum = NULL);
   ~SparseTable() {
   }
 
@@ -65,90 +381,176 @@ public:
   bool contains(const K& k);
   void put(const K& k, const V& v);
   void update(const K& k, const V& v);
-  void remove(const K& k) {
-    LOG(FATAL)<< "Not implemented.";
-  }
+  void remove(const K& k);
   void resize(int64_t size);
 
+  void getMany(const K* keys, int count, V* out);
+  void containsMany(const K* keys, int count, bool* out);
+  void updateMany(const K* keys, const V* values, int count);
+
+  // Local shards are not registered on their own; the owning ShardedTable
+  // carries the table id.
+  int32_t id() {return -1;}
+  int32_t numShards() {return 1;}
+
   bool empty() {return size() == 0;}
-  int64_t size() {return entries_;}
-  int64_t capacity() {return size_;}
+  int64_t size() {return cur_.entries + old_.entries;}
+  int64_t capacity() {return cur_.size;}
+
+  // How the bucket array is backed (heap, mmap or huge pages).
+  MemoryBacking backing() const {return cur_.buckets.backing();}
+
+  // True while entries are being migrated out of a smaller bucket array.
+  bool resizing() const {return old_.size > 0;}
 
+  // Constant time: see Storage::clear().
   void clear() {
-    for (int i = 0; i < size_; ++i) {buckets_[i].in_use = 0;}
-    entries_ = 0;
+    old_.release();
+    cur_.clear();
+    values_.reset();
   }
 
+  void reserve(int64_t new_size) {
+    if (new_size > cur_.size * kLoadFactor) {
+      resize((int64_t) (1 + new_size / kLoadFactor));
+    }
+  }
+
+  void swap(Table* t);
+
   TableIterator *get_iterator() {
     return new Iterator(*this);
   }
 
+  TableIteratorT<K, V>* typedIterator() {
+    return new Iterator(*this);
+  }
+
+  void typedIterators(int count, std::vector<TableIteratorT<K, V>*>* out) {
+    std::vector<Iterator*> r;
+    ranges(count, &r);
+    out->insert(out->end(), r.begin(), r.end());
+    if (r.empty()) {
+      out->push_back(new Iterator(*this));
+    }
+  }
+
+  // Untyped operations
+  bool containsStr(const StringPiece& k) {
+    return contains(unmarshal<K>(k));
+  }
+
+  string getStr(const StringPiece &k) {
+    return marshal(get(unmarshal<K>(k)));
+  }
+
+  void putStr(const StringPiece &k, const StringPiece &v) {
+    put(unmarshal<K>(k), unmarshal<V>(v));
+  }
+
+  void updateStr(const StringPiece &k, const StringPiece &v) {
+    update(unmarshal<K>(k), unmarshal<V>(v));
+  }
+
+  TableIterator* iterator() {
+    return get_iterator();
+  }
+
   void write(TableCoder *out);
   int64_t read(TableCoder *in);
   void applyUpdates(TableCoder *in);
 
 private:
-  uint32_t bucket_idx(K k) {
-    return hashobj_(k) % size_;
+  static uint64_t hash(const K& k) {
+    return Hasher()(k);
   }
 
-  int bucket_for_key(const K& k) {
-    int start = bucket_idx(k);
-    int b = start;
-    int tries = 0;
+  // The low bits of the hash select the home bucket, the top 7 bits form
+  // the control tag.
+  static uint8_t tag_for_hash(uint64_t h) {
+    return h >> 57;
+  }
 
-    do {
-      ++tries;
-      if (buckets_[b].in_use) {
-        if (buckets_[b].k == k) {
-          return b;
-        }
-      } else {
-        return -1;
+  // Hash up to kPrefetchBatch keys into 'h' and prefetch the control bytes
+  // and home bucket of each, so their misses overlap.
+  void hash_batch(const K* keys, int count, uint64_t* h) {
+    for (int i = 0; i < count; ++i) {
+      h[i] = hash(keys[i]);
+      int64_t pos = h[i] & cur_.mask;
+      __builtin_prefetch(&cur_.ctrl[pos]);
+      __builtin_prefetch(&cur_.buckets[pos]);
+    }
+  }
+
+  // Return the bucket holding 'k' in either bucket array, or NULL.
+  Bucket* find(const K& k, uint64_t h) {
+    int64_t b = cur_.find(k, h);
+    if (b != -1) {
+      return &cur_.buckets[b];
+    }
+    if (resizing()) {
+      b = old_.find(k, h);
+      if (b != -1) {
+        return &old_.buckets[b];
       }
+    }
+    return NULL;
+  }
 
-      b = (b + 1) % size_;
-    }while (b != start);
+  // Insert a key known not to be present, growing the table if needed.
+  void insert_new(const K& k, const V& v, uint64_t h);
+  void grow();
 
-    return -1;
+  // Move up to 'budget' buckets' worth of entries from old_ into cur_.
+  void migrate(int64_t budget);
+  void finish_resize() {
+    migrate(std::numeric_limits<int64_t>::max());
   }
 
-  std::vector<Bucket> buckets_;
+  Storage cur_;
+  Storage old_;
+  int64_t migrate_pos_;
 
-  int64_t entries_;
-  int64_t size_;
-  int bitset_epoch_;
+  Arena<V> values_;
 
-  std::tr1::hash<K> hashobj_;
-};
+  Accumulator<V>* accum_;
 
-template<class K, class V>
-SparseTable<K, V>::SparseTable(int size) :
-    buckets_(0), entries_(0), size_(0), bitset_epoch_(0) {
-  clear();
+  friend struct SparseTableTest;
+};
 
+template<class K, class V, class Hasher>
+SparseTable<K, V, Hasher>::SparseTable(int size, Accumulator<V>* accum) :
+    migrate_pos_(0), accum_(accum) {
   resize(size);
 }
 
-template<class K, class V>
-void SparseTable<K, V>::write(TableCoder *out) {
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::write(TableCoder *out) {
+  {
+    Iterator it(*this);
+    if (WriteBulk<K, V>(out, &it, size())) {
+      return;
+    }
+  }
+
   Iterator *i = (Iterator*) get_iterator();
-  string k, v;
+  string buf;
   while (!i->done()) {
-    k.clear();
-    v.clear();
-    marshal(i->key(), &k);
-    marshal(i->value(), &v);
-    out->write(k, v);
+    buf.clear();
+    marshalAppend(i->key(), &buf);
+    int klen = buf.size();
+    marshalAppend(i->value(), &buf);
+    out->write(StringPiece(buf.data(), klen),
+        StringPiece(buf.data() + klen, buf.size() - klen));
     i->Next();
   }
   delete i;
 }
 
-template<class K, class V>
-int64_t SparseTable<K, V>::read(TableCoder *in) {
+template<class K, class V, class Hasher>
+int64_t SparseTable<K, V, Hasher>::read(TableCoder *in) {
   string k, v;
-  int updates = 0;
+  int64_t updates = ApplyBulk<K, V>(in, this);
   while (in->read(&k, &v)) {
     this->updateStr(k, v);
     updates++;
@@ -156,8 +558,10 @@ int64_t SparseTable<K, V>::read(TableCoder *in) {
   return updates;
 }
 
-template<class K, class V>
-void SparseTable<K, V>::applyUpdates(TableCoder *in) {
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::applyUpdates(TableCoder *in) {
+  ApplyBulk<K, V>(in, this);
+
   K k;
   V v;
   string kt, vt;
@@ -169,90 +573,253 @@ void SparseTable<K, V>::applyUpdates(TableCoder *in) {
   }
 }
 
-template<class K, class V>
-void SparseTable<K, V>::resize(int64_t size) {
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::resize(int64_t size) {
   CHECK_GT(size, 0);
-  VLOG(1) << "Resizing/rehashing table " << this->id << "... " << entries_ << " : "
-             << size_ << " -> " << size;
+  finish_resize();
+
+  // Capacities are powers of two (and at least one probe group wide), so
+  // bucket selection is a mask rather than a division.
+  int64_t capacity = kGroupWidth;
+  while (capacity < size || capacity * kLoadFactor < cur_.entries + 1) {
+    capacity <<= 1;
+  }
+
+  VLOG(1) << "Resizing/rehashing table... " << cur_.entries << " : "
+             << cur_.size << " -> " << capacity;
 
-  if (size_ == size)
+  if (cur_.size == capacity)
     return;
 
-  std::vector<Bucket> old_b = buckets_;
+  Storage old;
+  old.swap(cur_);
+  cur_.allocate(capacity);
+
+  for (int64_t i = 0; i < old.size; ++i) {
+    if (old.is_full(i)) {
+      int64_t b = cur_.insert(old.buckets[i].k, hash(old.buckets[i].k));
+      cur_.buckets[b].v = old.buckets[i].v;
+    }
+  }
+
+  CHECK_EQ(old.entries, cur_.entries);
+}
+
+// Large tables grow incrementally: the full bucket array is kept as old_,
+// a new one twice the size becomes cur_, and every subsequent operation
+// migrates a few old buckets.  This bounds the latency of any single insert
+// instead of stalling for a full rehash.
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::grow() {
+  finish_resize();
+
+  if (FLAGS_sparse_table_incremental_resize <= 0 ||
+      cur_.size < FLAGS_sparse_table_incremental_resize) {
+    resize(cur_.size * 2);
+    return;
+  }
 
-  int old_entries = entries_;
+  VLOG(1) << "Starting incremental resize... " << cur_.entries << " : "
+             << cur_.size << " -> " << cur_.size * 2;
 
-  buckets_.resize(size);
-  size_ = size;
-  clear();
+  old_.swap(cur_);
+  cur_.allocate(old_.size * 2);
+  migrate_pos_ = 0;
+}
 
-  for (size_t i = 0; i < old_b.size(); ++i) {
-    if (old_b[i].in_use) {
-      put(old_b[i].k, old_b[i].v);
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::migrate(int64_t budget) {
+  while (old_.entries > 0 && budget-- > 0) {
+    if (!old_.is_full(migrate_pos_)) {
+      ++migrate_pos_;
+      continue;
     }
+
+    // Erasing shifts the rest of the cluster back into this bucket, so it
+    // is examined again on the next step.  Buckets before migrate_pos_ are
+    // always empty.
+    Bucket& b = old_.buckets[migrate_pos_];
+    cur_.buckets[cur_.insert(b.k, hash(b.k))].v = b.v;
+    old_.erase(migrate_pos_);
   }
 
-  CHECK_EQ(old_entries, entries_);
+  if (resizing() && old_.entries == 0) {
+    old_.release();
+    migrate_pos_ = 0;
+  }
 }
 
-template<class K, class V>
-bool SparseTable<K, V>::contains(const K& k) {
-  return bucket_for_key(k) != -1;
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::swap(Table* t) {
+  SparseTable<K, V, Hasher>* o = static_cast<SparseTable<K, V, Hasher>*>(t);
+  cur_.swap(o->cur_);
+  old_.swap(o->old_);
+  std::swap(migrate_pos_, o->migrate_pos_);
+  values_.swap(o->values_);
+}
+
+template<class K, class V, class Hasher>
+bool SparseTable<K, V, Hasher>::contains(const K& k) {
+  return find(k, hash(k)) != NULL;
+}
+
+template<class K, class V, class Hasher>
+V SparseTable<K, V, Hasher>::get(const K& k) {
+  Bucket* b = find(k, hash(k));
+
+  CHECK(b != NULL)<< "No entry for requested key";
+
+  return b->v.get();
 }
 
-template<class K, class V>
-V SparseTable<K, V>::get(const K& k) {
-  int b = bucket_for_key(k);
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::update(const K& k, const V& v) {
+  if (resizing()) {
+    migrate(kResizeStep);
+  }
 
-  CHECK_NE(b, -1)<< "No entry for requested key";
+  uint64_t h = hash(k);
+  Bucket* b = find(k, h);
+  if (b != NULL) {
+    accum_->Accumulate(&b->v.get(), v);
+  } else {
+    insert_new(k, v, h);
+  }
+}
 
-  return buckets_[b].v;
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::put(const K& k, const V& v) {
+  if (resizing()) {
+    migrate(kResizeStep);
+  }
+
+  uint64_t h = hash(k);
+  Bucket* b = find(k, h);
+  if (b != NULL) {
+    // Replacing an existing entry
+    b->v.get() = v;
+  } else {
+    insert_new(k, v, h);
+  }
 }
 
-template<class K, class V>
-void SparseTable<K, V>::update(const K& k, const V& v) {
-  int b = bucket_for_key(k);
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::remove(const K& k) {
+  if (resizing()) {
+    migrate(kResizeStep);
+  }
+
+  uint64_t h = hash(k);
+  int64_t b = cur_.find(k, h);
   if (b != -1) {
-    static_cast<Accumulator<V>*>(this->accumulator)->Accumulate(&buckets_[b].v,
-        v);
+    cur_.buckets[b].v.release(&values_);
+    cur_.erase(b);
+  } else if (resizing() && (b = old_.find(k, h)) != -1) {
+    old_.buckets[b].v.release(&values_);
+    old_.erase(b);
   }
 }
 
-template<class K, class V>
-void SparseTable<K, V>::put(const K& k, const V& v) {
-  int start = bucket_idx(k);
-  int b = start;
-  bool found = false;
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::getMany(const K* keys, int count, V* out) {
+  uint64_t h[kPrefetchBatch];
+  for (int start = 0; start < count; start += kPrefetchBatch) {
+    int n = std::min(kPrefetchBatch, count - start);
+    hash_batch(keys + start, n, h);
+    for (int i = 0; i < n; ++i) {
+      Bucket* b = find(keys[start + i], h[i]);
+      CHECK(b != NULL)<< "No entry for requested key";
+      out[start + i] = b->v.get();
+    }
+  }
+}
 
-  do {
-    if (!buckets_[b].in_use) {
-      break;
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::containsMany(const K* keys, int count, bool* out) {
+  uint64_t h[kPrefetchBatch];
+  for (int start = 0; start < count; start += kPrefetchBatch) {
+    int n = std::min(kPrefetchBatch, count - start);
+    hash_batch(keys + start, n, h);
+    for (int i = 0; i < n; ++i) {
+      out[start + i] = find(keys[start + i], h[i]) != NULL;
     }
+  }
+}
 
-    if (buckets_[b].k == k) {
-      found = true;
-      break;
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::updateMany(const K* keys, const V* values, int count) {
+  uint64_t h[kPrefetchBatch];
+  for (int start = 0; start < count; start += kPrefetchBatch) {
+    int n = std::min(kPrefetchBatch, count - start);
+    if (resizing()) {
+      migrate(kResizeStep);
     }
+    hash_batch(keys + start, n, h);
+    for (int i = 0; i < n; ++i) {
+      Bucket* b = find(keys[start + i], h[i]);
+      if (b != NULL) {
+        accum_->Accumulate(&b->v.get(), values[start + i]);
+      } else {
+        insert_new(keys[start + i], values[start + i], h[i]);
+      }
+    }
+  }
+}
 
-    b = (b + 1) % size_;
-  } while (b != start);
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::insert_new(const K& k, const V& v, uint64_t h) {
+  if (size() + 1 > cur_.size * kLoadFactor) {
+    grow();
+  }
+  cur_.buckets[cur_.insert(k, h)].v.store(&values_, v);
+}
 
-// Inserting a new entry:
-  if (!found) {
-    if (entries_ > size_ * kLoadFactor) {
-      resize((int) (1 + size_ * 2));
-      put(k, v);
-    } else {
-      buckets_[b].in_use = 1;
-      buckets_[b].k = k;
-      buckets_[b].v = v;
+// Robin Hood insertion: walk from the home bucket and claim the first slot
+// whose resident is closer to its own home than we are to ours.  The rest
+// of the cluster shifts down by one, which keeps every cluster ordered by
+// home bucket and the variance of probe lengths low.
+template<class K, class V, class Hasher>
+int64_t SparseTable<K, V, Hasher>::Storage::insert(const K& k, uint64_t h) {
+  int64_t b = h & mask;
+  int64_t dist = 0;
+  while (is_full(b) && displacement(b) >= dist) {
+    b = (b + 1) & mask;
+    ++dist;
+  }
 
-      ++entries_;
+  if (is_full(b)) {
+    int64_t e = free_bucket(b);
+    while (e != b) {
+      int64_t prev = (e - 1) & mask;
+      std::swap(buckets[e], buckets[prev]);
+      set_ctrl(e, ctrl[prev]);
+      e = prev;
     }
-  } else {
-    // Replacing an existing entry
-    buckets_[b].v = v;
   }
+
+  set_ctrl(b, tag_for_hash(h));
+  buckets[b].k = k;
+
+  ++entries;
+  return b;
+}
+
+// Backward-shift deletion: pull the following entries of the cluster back
+// by one until we reach a free bucket or an entry already in its home slot.
+// No tombstones are left behind, so lookups still stop at the first free
+// bucket.
+template<class K, class V, class Hasher>
+void SparseTable<K, V, Hasher>::Storage::erase(int64_t b) {
+  int64_t next = (b + 1) & mask;
+  while (is_full(next) && displacement(next) > 0) {
+    std::swap(buckets[b], buckets[next]);
+    set_ctrl(b, ctrl[next]);
+    b = next;
+    next = (next + 1) & mask;
+  }
+
+  set_ctrl(b, kCtrlEmpty);
+  --entries;
 }
 
 } /* namespace piccolo */
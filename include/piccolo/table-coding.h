@@ -0,0 +1,258 @@
+#ifndef TABLE_CODING_H_
+#define TABLE_CODING_H_
+
+#include "util/coding.h"
+#include "util/common.h"
+#include "util/marshal.h"
+
+#include "piccolo/table.h"
+
+#include <algorithm>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+DECLARE_bool(delta_table_data);
+
+namespace piccolo {
+
+// Bulk blocks carry the entries of a table whose keys and values are both
+// raw-marshalled PODs (see IsRawMarshal), without per-entry framing.
+//
+// BULK_PACKED stores the raw key array and then the raw value array.
+//
+// BULK_DELTA (--delta_table_data) sorts the entries by key and stores each
+// key as the zigzag varint difference from the previous one, word by word:
+// an integer key is a single word, and a struct of 32-bit fields such as
+// PageId is one word per field.  Integer values are zigzag varints; other
+// values are stored raw.  Dense or clustered keys then take a byte or two
+// each instead of their full width.
+
+// Word-wise view of a key for BULK_DELTA.
+template<class K, bool Integral = boost::is_integral<K>::value>
+struct DeltaKey {
+  typedef uint32_t Word;
+  static const bool kApplies = sizeof(K) % sizeof(Word) == 0;
+};
+
+template<class K>
+struct DeltaKey<K, true> {
+  typedef K Word;
+  static const bool kApplies = true;
+};
+
+template<class K>
+class DeltaKeyCodec {
+public:
+  typedef typename DeltaKey<K>::Word Word;
+  static const int kWords = sizeof(K) >= sizeof(Word) ? sizeof(K) / sizeof(Word) : 1;
+
+  DeltaKeyCodec() {
+    memset(prev_, 0, sizeof(prev_));
+  }
+
+  static Word word(const K& k, int i) {
+    Word w;
+    memcpy(&w, reinterpret_cast<const char*>(&k) + i * sizeof(Word), sizeof(Word));
+    return w;
+  }
+
+  // Orders keys word by word, which is the order that keeps deltas small.
+  struct Less {
+    bool operator()(const std::pair<K, int64_t>& a,
+        const std::pair<K, int64_t>& b) const {
+      for (int i = 0; i < kWords; ++i) {
+        Word wa = word(a.first, i), wb = word(b.first, i);
+        if (wa != wb) {
+          return wa < wb;
+        }
+      }
+      return false;
+    }
+  };
+
+  void encode(const K& k, string* out) {
+    for (int i = 0; i < kWords; ++i) {
+      // Signed words are sign-extended so a step across zero stays small.
+      uint64_t cur = int64_t(word(k, i));
+      PutVarint64(ZigZag(cur - prev_[i]), out);
+      prev_[i] = cur;
+    }
+  }
+
+  void decode(const char** p, const char* end, K* k) {
+    for (int i = 0; i < kWords; ++i) {
+      prev_[i] += UnZigZag(GetVarint64(p, end));
+      Word w = Word(prev_[i]);
+      memcpy(reinterpret_cast<char*>(k) + i * sizeof(Word), &w, sizeof(Word));
+    }
+  }
+
+private:
+  uint64_t prev_[kWords];
+};
+
+template<class V>
+void EncodeDeltaValue(const V& v, string* out, boost::true_type) {
+  PutVarint64(ZigZag(int64_t(v)), out);
+}
+
+template<class V>
+void EncodeDeltaValue(const V& v, string* out, boost::false_type) {
+  out->append(reinterpret_cast<const char*>(&v), sizeof(V));
+}
+
+template<class V>
+void DecodeDeltaValue(const char** p, const char* end, V* v, boost::true_type) {
+  *v = V(UnZigZag(GetVarint64(p, end)));
+}
+
+template<class V>
+void DecodeDeltaValue(const char** p, const char* end, V* v, boost::false_type) {
+  CHECK_LE(*p + sizeof(V), end);
+  memcpy(v, *p, sizeof(V));
+  *p += sizeof(V);
+}
+
+template<class K, class V, class Iter>
+void WriteDeltaBlock(Iter* it, int64_t count, BulkHeader* h, string* block) {
+  std::vector<std::pair<K, int64_t> > keys;
+  std::vector<V> values;
+  keys.reserve(count);
+  values.reserve(count);
+  for (; !it->done(); it->Next()) {
+    keys.push_back(std::make_pair(it->key(), int64_t(values.size())));
+    values.push_back(it->value());
+  }
+  std::sort(keys.begin(), keys.end(), typename DeltaKeyCodec<K>::Less());
+
+  DeltaKeyCodec<K> codec;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    codec.encode(keys[i].first, block);
+  }
+  h->key_bytes = block->size() - sizeof(BulkHeader);
+
+  for (size_t i = 0; i < keys.size(); ++i) {
+    EncodeDeltaValue(values[keys[i].second], block, boost::is_integral<V>());
+  }
+  h->value_bytes = block->size() - sizeof(BulkHeader) - h->key_bytes;
+}
+
+template<class K, class V, class Iter>
+void WritePackedBlock(Iter* it, int64_t count, BulkHeader* h, string* block) {
+  h->key_bytes = count * sizeof(K);
+  h->value_bytes = count * sizeof(V);
+  block->resize(h->bytes());
+  char* keys = &(*block)[0] + sizeof(BulkHeader);
+  char* values = keys + h->key_bytes;
+
+  int64_t i = 0;
+  for (; !it->done(); it->Next(), ++i) {
+    CHECK_LT(i, count);
+    memcpy(keys + i * sizeof(K), &it->key(), sizeof(K));
+    memcpy(values + i * sizeof(V), &it->value(), sizeof(V));
+  }
+  CHECK_EQ(i, count);
+}
+
+// Write the 'count' entries of 'it' to 'out' as a single bulk block.  This
+// applies only when both K and V are raw-marshalled PODs and 'out' accepts
+// blocks; otherwise nothing is written and false is returned.
+template<class K, class V, class Iter>
+bool WriteBulk(TableCoder* out, Iter* it, int64_t count, boost::false_type) {
+  return false;
+}
+
+template<class K, class V, class Iter>
+bool WriteBulk(TableCoder* out, Iter* it, int64_t count, boost::true_type) {
+  BulkHeader h;
+  h.count = count;
+  h.key_size = sizeof(K);
+  h.value_size = sizeof(V);
+
+  string block(sizeof(h), '\0');
+  if (FLAGS_delta_table_data && DeltaKey<K>::kApplies) {
+    h.format = BULK_DELTA;
+    WriteDeltaBlock<K, V>(it, count, &h, &block);
+  } else {
+    h.format = BULK_PACKED;
+    WritePackedBlock<K, V>(it, count, &h, &block);
+  }
+  memcpy(&block[0], &h, sizeof(h));
+
+  return out->writeBulk(block);
+}
+
+template<class K, class V, class Iter>
+bool WriteBulk(TableCoder* out, Iter* it, int64_t count) {
+  return WriteBulk<K, V>(out, it, count, boost::integral_constant<bool,
+      IsRawMarshal<K>::value && IsRawMarshal<V>::value>());
+}
+
+// Apply every bulk block in 'in' to 't' with updateMany(), and return the
+// number of entries applied.
+template<class K, class V>
+int64_t ApplyBulk(TableCoder* in, TableT<K, V>* t, boost::false_type) {
+  return 0;
+}
+
+template<class K, class V>
+int64_t ApplyBulk(TableCoder* in, TableT<K, V>* t, boost::true_type) {
+  static const int kBatch = 256;
+  K keys[kBatch];
+  V values[kBatch];
+
+  int64_t applied = 0;
+  StringPiece block;
+  while (in->readBulk(&block)) {
+    BulkHeader h;
+    memcpy(&h, block.data, sizeof(h));
+    CHECK_EQ(h.key_size, sizeof(K));
+    CHECK_EQ(h.value_size, sizeof(V));
+    CHECK_EQ(h.bytes(), block.len);
+
+    // The sections must hold exactly 'count' entries: packed ones by
+    // their sizes, delta ones once decoded.
+    if (h.format == BULK_PACKED) {
+      CHECK_EQ(h.key_bytes, h.count * sizeof(K));
+      CHECK_EQ(h.value_bytes, h.count * sizeof(V));
+    } else {
+      CHECK_EQ(h.format, BULK_DELTA);
+    }
+
+    const char* kp = block.data + sizeof(h);
+    const char* vp = kp + h.key_bytes;
+    const char* kend = vp;
+    const char* end = vp + h.value_bytes;
+    DeltaKeyCodec<K> codec;
+    for (int64_t start = 0; start < h.count; start += kBatch) {
+      int n = std::min<int64_t>(kBatch, h.count - start);
+      if (h.format == BULK_PACKED) {
+        memcpy(keys, kp + start * sizeof(K), n * sizeof(K));
+        memcpy(values, vp + start * sizeof(V), n * sizeof(V));
+      } else {
+        for (int i = 0; i < n; ++i) {
+          codec.decode(&kp, kend, &keys[i]);
+          DecodeDeltaValue(&vp, end, &values[i], boost::is_integral<V>());
+        }
+      }
+      t->updateMany(keys, values, n);
+    }
+    if (h.format == BULK_DELTA) {
+      CHECK(kp == kend) << "Delta block keys do not end with their section.";
+      CHECK(vp == end) << "Delta block values do not end with their section.";
+    }
+    applied += h.count;
+  }
+  return applied;
+}
+
+template<class K, class V>
+int64_t ApplyBulk(TableCoder* in, TableT<K, V>* t) {
+  return ApplyBulk<K, V>(in, t, boost::integral_constant<bool,
+      IsRawMarshal<K>::value && IsRawMarshal<V>::value>());
+}
+
+}
+
+#endif /* TABLE_CODING_H_ */
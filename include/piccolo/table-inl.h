@@ -2,94 +2,120 @@
 #define TABLE_INL_H_
 
 #include <algorithm>
+#include <map>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include "piccolo/table.h"
 #include "piccolo/sparse-table.h"
+#include "piccolo/dense-table.h"
+#include "piccolo/concurrent-table.h"
 
 #include "util/common.h"
 #include "util/rpc.h"
 #include "util/timer.h"
 
+DECLARE_double(remote_flush_interval);
+DECLARE_int64(remote_cache_entries);
+
 namespace piccolo {
 
+// Entries go to TableData.kv_data; bulk blocks are appended to
+// TableData.table_data.
 class ProtoTableCoder: public TableCoder {
 private:
   TableData* t_;
   int pos_;
+  int64_t bulk_pos_;
 public:
   ProtoTableCoder(TableData*);
   void write(StringPiece key, StringPiece value);
   bool read(string* key, string* value);
+  bool writeBulk(const StringPiece& block);
+  bool readBulk(StringPiece* block);
 };
 
+// Iterates over a shard owned by another worker.  Up to kPrefetchPages
+// pages are requested ahead of the one being read, so the owner keeps
+// sending while the caller consumes.  Pages are sized in bytes, using the
+// average row size seen so far; the page size doubles whenever the
+// caller still has to wait for a page, until the pages in flight cover
+// the round trip.
 class RemoteIterator: public TableIterator {
 public:
   RemoteIterator(ShardedTable* table, int shard);
+  ~RemoteIterator();
   void keyStr(string* out);
   void valueStr(string* out);
   bool done();
   void Next();
 
 private:
+  void prefetch();
+  void nextPage();
+  bool receive(int key, IteratorResponse* resp);
+
+  // Block until receive() succeeds.
+  void waitFor(int key, IteratorResponse* resp);
+  int pageRows();
+
   ShardedTable* owner_;
   IteratorRequest request_;
   IteratorResponse response_;
 
-  int pos_;
+  uint32_t pos_;
   int shard_;
-  bool done_;
-};
+  int worker_;
 
-class RemoteTable: public Table {
-public:
+  int inflight_;
+  double page_bytes_;
+  double row_bytes_;
 };
 
-template<class T, class K, class V>
-class ShardedTableImpl: public ShardedTable, public TableT<K, V> {
-private:
-  T* cast() {
-    return static_cast<T*>(this);
-  }
-
+// Matches replies to MTYPE_GET requests with the requests by
+// HashGet.index, so that any number of gets to a worker may be in flight
+// at once, from any thread.
+class RemoteGets: private boost::noncopyable {
 public:
-  ~ShardedTableImpl() {
-    for (int i = 0; i < shards_.size(); ++i) {
-      delete shards_[i];
-    }
-  }
+  static RemoteGets* Get();
 
-  void updateShards(const ShardInfo& info) {
-    shardInfo_[info.shard()].CopyFrom(info);
+  // Send 'req' to 'worker' and return the index its reply will carry.
+  uint32_t send(int worker, HashGet* req);
 
-  }
+  // Return true and fill in '*resp' if the reply to request 'index' has
+  // arrived from 'worker'.
+  bool tryReceive(int worker, uint32_t index, TableData* resp);
+  void receive(int worker, uint32_t index, TableData* resp);
 
-  int64_t shardSize(int shard) {
-    return shardInfo_[shard].entries();
-  }
+private:
+  RemoteGets();
 
-  bool isLocalShard(int shard) {
-    return workerForShard(shard) == workerId_;
-  }
+  boost::mutex lock_;
+  uint32_t next_;
 
-  bool isLocalKey(const StringPiece &k) {
-    return workerId_ == shardForKeyStr(k);
-  }
+  // Replies read while looking for another request's.
+  std::map<uint32_t, TableData*> arrived_;
+};
 
-  Table* shard(int shard) {
-    return shards_[shard];
-  }
+// The buffer that stands in for a shard owned by another worker.
+class RemoteTable {
+public:
+  virtual ~RemoteTable() {}
 
-  ShardInfo* shardInfo(int shard) {
-    return &shardInfo_[shard];
-  }
+  // Send the buffered entries to the shard's owner and return how many
+  // were sent.
+  virtual int64_t flush() = 0;
 
-  int workerForShard(int shard) {
-    return shardInfo_[shard].owner();
-  }
-protected:
-  std::vector<ShardInfo> shardInfo_;
-  std::vector<Table*> shards_;
-  int32_t workerId_;
+  // Apply the buffered entries to 'local', which now holds the shard.
+  virtual void drainTo(Table* local) = 0;
+
+  // The number of put batches this process has sent to shard owners, for
+  // the barrier's termination detection.
+  static int64_t batchesSent();
+  static void countSent();
 };
 
 template<class K, class V>
@@ -98,19 +124,26 @@ private:
   TableIterator *iter_;
   K key_;
   V value_;
+  string buf_;
 public:
 
   TableIteratorTMixin(TableIterator *t) :
       iter_(t) {
   }
 
+  ~TableIteratorTMixin() {
+    delete iter_;
+  }
+
   const K& key() {
-    unmarshal(keyStr(), &key_);
+    iter_->keyStr(&buf_);
+    unmarshal(buf_, &key_);
     return key_;
   }
 
-  const V& value() {
-    unmarshal(valueStr(), &value_);
+  V& value() {
+    iter_->valueStr(&buf_);
+    unmarshal(buf_, &value_);
     return value_;
   }
 
@@ -142,6 +175,10 @@ public:
     return marshal(this->get(unmarshal<K>(s)));
   }
 
+  void putStr(const StringPiece& kstr, const StringPiece &vstr) {
+    this->put(unmarshal<K>(kstr), unmarshal<V>(vstr));
+  }
+
   void updateStr(const StringPiece& kstr, const StringPiece &vstr) {
     this->update(unmarshal<K>(kstr), unmarshal<V>(vstr));
   }
@@ -151,30 +188,574 @@ public:
   }
 };
 
-// Adds TableT<> to an untyped table.
+// Adds TableT<> to an untyped table.  Keys and values are marshalled
+// back to back into one reused buffer.
 template<class K, class V, class Base>
 class TypedTableMixin: public Base {
 public:
   void put(const K &k, const V &v) {
-    this->putStr(marshal<K>(k), marshal<V>(v));
+    int klen = encode(k, v);
+    this->putStr(StringPiece(buf_.data(), klen),
+        StringPiece(buf_.data() + klen, buf_.size() - klen));
   }
 
   void update(const K &k, const V &v) {
-    this->updateStr(marshal<K>(k), marshal<V>(v));
+    int klen = encode(k, v);
+    this->updateStr(StringPiece(buf_.data(), klen),
+        StringPiece(buf_.data() + klen, buf_.size() - klen));
   }
 
   // Return the value associated with 'k', possibly blocking for a remote fetch.
   V get(const K &k) {
-    return unmarshal<V>(this->getStr(k));
+    buf_.clear();
+    marshalAppend(k, &buf_);
+    return unmarshal<V>(this->getStr(buf_));
   }
 
   bool contains(const K &k) {
-    return this->containsStr(marshal<K>(k));
+    buf_.clear();
+    marshalAppend(k, &buf_);
+    return this->containsStr(buf_);
   }
 
   TableIteratorT<K, V>* typedIterator() {
     return new TableIteratorTMixin<K, V>(this->iterator());
   }
+
+private:
+  // Encode 'k' then 'v' into buf_ and return the length of the key.
+  int encode(const K& k, const V& v) {
+    buf_.clear();
+    marshalAppend(k, &buf_);
+    int klen = buf_.size();
+    marshalAppend(v, &buf_);
+    return klen;
+  }
+
+  string buf_;
+};
+
+
+// Buffers the writes this worker makes to a shard owned by another
+// worker.  Updates to the same key are combined with the table's
+// accumulator before anything is sent, and puts replace whatever is
+// buffered for their key, so each key costs one entry per flush however
+// often it was written.
+//
+// A buffer is flushed when it holds kWriteFlushCount entries, when it
+// has gone --remote_flush_interval seconds without a flush, and at every
+// barrier.  Reads go to the owner and do not see buffered writes.
+//
+// Values read from the owner are cached, up to --remote_cache_entries
+// per shard, until the table's epoch changes (see
+// ShardedTable::advanceEpoch()).  Repeated reads of a remote key within a
+// kernel then cost one fetch.
+template<class K, class V>
+class RemoteTableT: public UntypedTableMixin<K, V, TableT<K, V> >,
+    public RemoteTable, private boost::noncopyable {
+public:
+  RemoteTableT(ShardedTable* owner, int shard, Accumulator<V>* accum) :
+      owner_(owner), shard_(shard), updates_(1, accum), puts_(1, accum),
+      ops_(0), last_flush_(Now()), cache_epoch_(-1) {
+  }
+
+  void update(const K& k, const V& v) {
+    boost::mutex::scoped_lock sl(lock_);
+    if (puts_.contains(k)) {
+      puts_.update(k, v);
+    } else {
+      updates_.update(k, v);
+    }
+    maybeFlush();
+  }
+
+  void put(const K& k, const V& v) {
+    boost::mutex::scoped_lock sl(lock_);
+    updates_.remove(k);
+    puts_.put(k, v);
+    maybeFlush();
+  }
+
+  V get(const K& k) {
+    V v;
+    if (cached(k, &v)) {
+      return v;
+    }
+
+    int epoch = owner_->epoch();
+    TableData resp;
+    fetch(k, &resp);
+    CHECK(!resp.missing_key()) << "No entry for requested key";
+    unmarshal(resp.kv_data(0).value(), &v);
+    cache(k, v, epoch);
+    return v;
+  }
+
+  bool contains(const K& k) {
+    V v;
+    if (cached(k, &v)) {
+      return true;
+    }
+
+    int epoch = owner_->epoch();
+    TableData resp;
+    fetch(k, &resp);
+    if (!resp.missing_key()) {
+      cache(k, unmarshal<V>(resp.kv_data(0).value()), epoch);
+    }
+    return !resp.missing_key();
+  }
+
+  void remove(const K& k) {
+    LOG(FATAL) << "Removing keys from a remote shard is not supported.";
+  }
+
+  int64_t flush() {
+    boost::mutex::scoped_lock sl(lock_);
+    return flushLocked();
+  }
+
+  void drainTo(Table* local) {
+    boost::mutex::scoped_lock sl(lock_);
+    TableT<K, V>* t = static_cast<TableT<K, V>*>(local);
+    for (typename Buffer::Iterator it(puts_); !it.done(); it.Next()) {
+      t->put(it.key(), it.value());
+    }
+    for (typename Buffer::Iterator it(updates_); !it.done(); it.Next()) {
+      t->update(it.key(), it.value());
+    }
+    puts_.clear();
+    updates_.clear();
+  }
+
+  // Queue every entry of 'local' to overwrite the new owner's values.
+  void putAll(Table* local) {
+    TableT<K, V>* t = static_cast<TableT<K, V>*>(local);
+    boost::scoped_ptr<TableIteratorT<K, V> > it(t->typedIterator());
+    for (; !it->done(); it->Next()) {
+      put(it->key(), it->value());
+    }
+  }
+
+  int32_t id() {
+    return owner_->id();
+  }
+
+  int32_t numShards() {
+    return 1;
+  }
+
+  // The number of buffered entries.
+  int64_t size() {
+    boost::mutex::scoped_lock sl(lock_);
+    return updates_.size() + puts_.size();
+  }
+
+  bool empty() {
+    return size() == 0;
+  }
+
+  void clear() {
+    boost::mutex::scoped_lock sl(lock_);
+    updates_.clear();
+    puts_.clear();
+  }
+
+  void reserve(int64_t new_size) {
+  }
+
+  void swap(Table* t) {
+    RemoteTableT<K, V>* o = static_cast<RemoteTableT<K, V>*>(t);
+    updates_.swap(&o->updates_);
+    puts_.swap(&o->puts_);
+  }
+
+  TableIteratorT<K, V>* typedIterator() {
+    return new TableIteratorTMixin<K, V>(new RemoteIterator(owner_, shard_));
+  }
+
+  // Return true and set '*v' if 'k' was read in the current epoch.
+  bool cached(const K& k, V* v) {
+    if (FLAGS_remote_cache_entries <= 0) {
+      return false;
+    }
+
+    boost::mutex::scoped_lock sl(cache_lock_);
+    if (cache_epoch_ != owner_->epoch()) {
+      cache_.clear();
+      cache_epoch_ = owner_->epoch();
+      return false;
+    }
+    if (!cache_.contains(k)) {
+      return false;
+    }
+    *v = cache_.get(k);
+    return true;
+  }
+
+  // Remember a value fetched in 'epoch', unless the epoch has since
+  // moved on.  A full cache is simply emptied.
+  void cache(const K& k, const V& v, int epoch) {
+    if (FLAGS_remote_cache_entries <= 0) {
+      return;
+    }
+
+    boost::mutex::scoped_lock sl(cache_lock_);
+    if (epoch != cache_epoch_) {
+      return;
+    }
+    if (cache_.size() >= FLAGS_remote_cache_entries) {
+      cache_.clear();
+    }
+    cache_.put(k, v);
+  }
+
+private:
+  typedef SparseTable<K, V> Buffer;
+
+  void fetch(const K& k, TableData* resp) {
+    HashGet req;
+    req.set_table(owner_->id());
+    req.set_shard(shard_);
+    req.set_key(marshal(k));
+    int worker = owner_->workerForShard(shard_);
+    RemoteGets* gets = RemoteGets::Get();
+    gets->receive(worker, gets->send(worker, &req), resp);
+  }
+
+  void maybeFlush() {
+    if (updates_.size() + puts_.size() >= kWriteFlushCount) {
+      flushLocked();
+    } else if (++ops_ % 1024 == 0
+        && Now() - last_flush_ >= FLAGS_remote_flush_interval) {
+      flushLocked();
+    }
+  }
+
+  int64_t flushLocked() {
+    last_flush_ = Now();
+    int64_t sent = updates_.size() + puts_.size();
+    if (!updates_.empty()) {
+      TableData req;
+      ProtoTableCoder coder(&req);
+      updates_.write(&coder);
+      send(&req);
+      updates_.clear();
+    }
+
+    // Puts go one entry at a time; bulk blocks are always accumulated.
+    if (!puts_.empty()) {
+      TableData req;
+      req.set_overwrite(true);
+      ProtoTableCoder coder(&req);
+      string k, v;
+      for (typename Buffer::Iterator it(puts_); !it.done(); it.Next()) {
+        it.keyStr(&k);
+        it.valueStr(&v);
+        coder.write(k, v);
+      }
+      send(&req);
+      puts_.clear();
+    }
+    return sent;
+  }
+
+  void send(TableData* req) {
+    rpc::NetworkThread* net = rpc::NetworkThread::Get();
+    req->set_source(net->id() - 1);
+    req->set_table(owner_->id());
+    req->set_shard(shard_);
+    req->set_done(true);
+    SendTableControl();
+    RemoteTable::countSent();
+    net->Send(owner_->workerForShard(shard_) + 1, MTYPE_PUT_REQUEST, *req);
+  }
+
+  ShardedTable* owner_;
+  int shard_;
+
+  boost::mutex lock_;
+  Buffer updates_;
+  Buffer puts_;
+
+  int64_t ops_;
+  double last_flush_;
+
+  boost::mutex cache_lock_;
+  Buffer cache_;
+  int cache_epoch_;
+};
+
+// The getAsync() calls on one table waiting for one worker.  Keys are
+// queued and sent as a single batched HashGet once kGetBatchSize have
+// accumulated, or as soon as any of their futures is polled, so a kernel
+// that issues all of its gets before waiting on the first pays for one
+// round trip per worker.  Values received are added to the read cache
+// of their RemoteTableT.
+template<class K, class V>
+class RemoteGetBatch: private boost::noncopyable {
+public:
+  typedef boost::shared_ptr<FutureState<V> > State;
+
+  RemoteGetBatch(ShardedTable* owner, int worker) :
+      owner_(owner), worker_(worker) {
+  }
+
+  // Futures still pending may outlive the table; they must not poll it.
+  ~RemoteGetBatch() {
+    for (size_t i = 0; i < queued_.size(); ++i) {
+      queued_[i].state->poll.clear();
+    }
+    for (typename InFlight::iterator i = inflight_.begin();
+        i != inflight_.end(); ++i) {
+      for (size_t j = 0; j < i->second.size(); ++j) {
+        i->second[j].state->poll.clear();
+      }
+    }
+  }
+
+  Future<V> add(int shard, const K& k) {
+    State s(new FutureState<V>);
+    s->poll = boost::bind(&RemoteGetBatch<K, V>::poll, this);
+
+    boost::mutex::scoped_lock sl(lock_);
+    queued_.push_back(Entry());
+    Entry& e = queued_.back();
+    marshal(k, &e.key);
+    e.shard = shard;
+    e.epoch = owner_->epoch();
+    e.state = s;
+    if (queued_.size() >= kGetBatchSize) {
+      sendLocked();
+    }
+    return Future<V>(s);
+  }
+
+  // Send any queued keys, and resolve the requests that have been
+  // answered.
+  void poll() {
+    boost::mutex::scoped_lock sl(lock_);
+    if (!queued_.empty()) {
+      sendLocked();
+    }
+
+    TableData resp;
+    typename InFlight::iterator i = inflight_.begin();
+    while (i != inflight_.end()) {
+      if (RemoteGets::Get()->tryReceive(worker_, i->first, &resp)) {
+        resolve(i->second, resp);
+        inflight_.erase(i++);
+      } else {
+        ++i;
+      }
+    }
+  }
+
+private:
+  struct Entry {
+    string key;
+    int shard;
+    int epoch;
+    State state;
+  };
+
+  typedef std::map<uint32_t, std::vector<Entry> > InFlight;
+
+  void sendLocked() {
+    HashGet req;
+    req.set_table(owner_->id());
+    req.set_shard(queued_[0].shard);
+    for (size_t i = 0; i < queued_.size(); ++i) {
+      req.add_keys(queued_[i].key);
+      req.add_shards(queued_[i].shard);
+    }
+    uint32_t index = RemoteGets::Get()->send(worker_, &req);
+    inflight_[index].swap(queued_);
+  }
+
+  // Only the keys found are returned, in request order, so the reply is
+  // matched against the request as a subsequence.
+  void resolve(std::vector<Entry>& entries, const TableData& resp) {
+    int j = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      FutureState<V>* s = entries[i].state.get();
+      s->found = j < resp.kv_data_size()
+          && resp.kv_data(j).key() == entries[i].key;
+      if (s->found) {
+        unmarshal(resp.kv_data(j++).value(), &s->value);
+        RemoteTableT<K, V>* r =
+            dynamic_cast<RemoteTableT<K, V>*>(owner_->shard(entries[i].shard));
+        if (r != NULL) {
+          r->cache(unmarshal<K>(entries[i].key), s->value, entries[i].epoch);
+        }
+      }
+      s->ready = true;
+    }
+  }
+
+  ShardedTable* owner_;
+  int worker_;
+
+  boost::mutex lock_;
+  std::vector<Entry> queued_;
+  InFlight inflight_;
+};
+
+template<class T, class K, class V>
+class ShardedTableImpl: public ShardedTable, public TableT<K, V> {
+private:
+  T* cast() {
+    return static_cast<T*>(this);
+  }
+
+public:
+  ~ShardedTableImpl() {
+    for (int i = 0; i < shards_.size(); ++i) {
+      delete shards_[i];
+    }
+    for (size_t i = 0; i < gets_.size(); ++i) {
+      delete gets_[i];
+    }
+  }
+
+  void init(int id, int numShards) {
+    id_ = id;
+    numShards_ = numShards;
+    workerId_ = -1;
+    attached_ = false;
+    epoch_ = 0;
+    lockShards_ = false;
+    locks_.reset(new ShardMutex[numShards]);
+
+    shardInfo_.resize(numShards);
+    shards_.resize(numShards, NULL);
+    remote_.resize(numShards, NULL);
+    for (int i = 0; i < numShards; ++i) {
+      shardInfo_[i].set_table(id);
+      shardInfo_[i].set_shard(i);
+      shardInfo_[i].set_entries(0);
+      shardInfo_[i].set_owner(-1);
+    }
+  }
+
+  void setWorkerId(int worker) {
+    workerId_ = worker;
+    attached_ = true;
+    for (int i = 0; i < rpc::NetworkThread::Get()->size() - 1; ++i) {
+      gets_.push_back(new RemoteGetBatch<K, V>(this, i));
+    }
+  }
+
+  // Local shards get a table from createLocal(); every other shard gets a
+  // remote buffer.  Entries buffered for a shard that becomes local are
+  // applied to the new table, and the entries of a shard that moves away
+  // are queued as puts for its new owner.
+  void assignShard(int shard, int worker) {
+    shardInfo_[shard].set_owner(worker);
+    if (!attached_) {
+      return;
+    }
+
+    bool local = worker == workerId_;
+    Table* old = shards_[shard];
+    RemoteTable* oldRemote = remote_[shard];
+    if (old != NULL && (oldRemote == NULL) == local) {
+      return;
+    }
+
+    if (local) {
+      shards_[shard] = cast()->createLocal();
+      remote_[shard] = NULL;
+      if (oldRemote != NULL) {
+        oldRemote->drainTo(shards_[shard]);
+      }
+    } else {
+      RemoteTableT<K, V>* r = cast()->createRemote(shard);
+      shards_[shard] = r;
+      remote_[shard] = r;
+      if (old != NULL) {
+        r->putAll(old);
+      }
+    }
+    delete old;
+  }
+
+  int64_t flush() {
+    int64_t sent = 0;
+    for (size_t i = 0; i < remote_.size(); ++i) {
+      if (remote_[i] != NULL) {
+        sent += remote_[i]->flush();
+      }
+    }
+    return sent;
+  }
+
+  int epoch() {
+    return epoch_;
+  }
+
+  void advanceEpoch() {
+    ++epoch_;
+  }
+
+  void updateShards(const ShardInfo& info) {
+    shardInfo_[info.shard()].CopyFrom(info);
+  }
+
+  int64_t shardSize(int shard) {
+    return shardInfo_[shard].entries();
+  }
+
+  bool isLocalShard(int shard) {
+    return workerId_ >= 0 && workerForShard(shard) == workerId_;
+  }
+
+  bool isMaster() {
+    return attached_ && workerId_ < 0;
+  }
+
+  // The lock serializing access to a local shard by concurrent kernels,
+  // or NULL if the shard needs none.
+  ShardMutex* shardLock(int shard) {
+    return lockShards_ && remote_[shard] == NULL ? &locks_[shard] : NULL;
+  }
+
+  bool isLocalKey(const StringPiece &k) {
+    return isLocalShard(this->shardForKeyStr(k));
+  }
+
+  Table* shard(int shard) {
+    return shards_[shard];
+  }
+
+  ShardInfo* shardInfo(int shard) {
+    return &shardInfo_[shard];
+  }
+
+  int workerForShard(int shard) {
+    return shardInfo_[shard].owner();
+  }
+protected:
+  int32_t id_;
+  int32_t numShards_;
+  int32_t workerId_;
+  bool attached_;
+  volatile int epoch_;
+
+  // Set when several kernel threads may use a local table that is not
+  // itself thread-safe.
+  bool lockShards_;
+  boost::scoped_array<ShardMutex> locks_;
+
+  std::vector<ShardInfo> shardInfo_;
+
+  // One entry per shard, NULL until the shard is assigned.  remote_[i] is
+  // the same object as shards_[i] when the shard is owned elsewhere.
+  std::vector<Table*> shards_;
+  std::vector<RemoteTable*> remote_;
+
+  // Pending getAsync() calls, by owning worker.
+  std::vector<RemoteGetBatch<K, V>*> gets_;
 };
 
 template<class K, class V, class Base>
@@ -183,51 +764,97 @@ private:
   TableT<K, V>* typedP(int idx) {
     return static_cast<TableT<K, V>*>(this->shard(idx));
   }
-  int32_t numShards_;
-  int32_t id_;
 public:
   int32_t id() {
-    return id_;
+    return this->id_;
   }
 
   int32_t numShards() {
-    return numShards_;
+    return this->numShards_;
   }
 
+  // clear(), reserve() and swap() act on the local shards of a worker.
+  // On the master they are queued for every worker; see
+  // QueueTableControl().
   void clear() {
     for (int i = 0; i < this->shards_.size(); ++i) {
-      typedP(i)->clear();
+      if (typedP(i) != NULL) {
+        typedP(i)->clear();
+      }
+      this->shardInfo_[i].set_entries(0);
+    }
+    this->advanceEpoch();
+
+    if (this->isMaster()) {
+      QueueTableControl(control(TableControl::CLEAR));
     }
   }
 
   bool empty() {
-    for (int i = 0; i < this->shards_.size(); ++i) {
-      if (!typedP(i)->empty()) {
-        return false;
-      }
-    }
-    return true;
+    return size() == 0;
   }
 
   void reserve(int64_t numEntries) {
+    if (this->isMaster()) {
+      TableControl::Op op = control(TableControl::RESERVE);
+      op.set_entries(numEntries);
+      QueueTableControl(op);
+      return;
+    }
+
     for (int i = 0; i < this->shards_.size(); ++i) {
-      typedP(i)->reserve(numEntries / this->shards_.size());
+      if (this->isLocalShard(i) && typedP(i) != NULL) {
+        typedP(i)->reserve(numEntries / this->numShards_);
+      }
     }
   }
 
+  // Entries held by all shard tables on this worker: the entries of local
+  // shards and the entries buffered for remote ones.
   int64_t size() {
     int64_t s = 0;
     for (int i = 0; i < this->shards_.size(); ++i) {
-      s += typedP(i)->size();
+      if (typedP(i) != NULL) {
+        s += typedP(i)->size();
+      }
     }
     return s;
   }
 
+  // Tables with the same shard count place shard i on the same worker, so
+  // swapping local shard tables and their sizes swaps the whole tables.
+  // Updates the master buffered for either table are sent first.
   void swap(Table* t) {
-    ShardedTable* other = dynamic_cast<ShardedTable*>(t);
+    ShardedTableBaseMixin* other = dynamic_cast<ShardedTableBaseMixin*>(t);
+    CHECK(other != NULL) << "Only tables of the same type can be swapped.";
+    CHECK_EQ(this->numShards_, other->numShards_);
+
+    if (this->isMaster()) {
+      this->flush();
+      other->flush();
+      TableControl::Op op = control(TableControl::SWAP);
+      op.set_other(other->id_);
+      QueueTableControl(op);
+    }
+
     for (int i = 0; i < this->shards_.size(); ++i) {
-      typedP(i)->swap(other->shard(i));
+      if (this->remote_[i] == NULL && other->remote_[i] == NULL) {
+        std::swap(this->shards_[i], other->shards_[i]);
+      }
+      int64_t entries = this->shardInfo_[i].entries();
+      this->shardInfo_[i].set_entries(other->shardInfo_[i].entries());
+      other->shardInfo_[i].set_entries(entries);
     }
+    this->advanceEpoch();
+    other->advanceEpoch();
+  }
+
+private:
+  TableControl::Op control(TableControl::Type type) {
+    TableControl::Op op;
+    op.set_type(type);
+    op.set_table(this->id_);
+    return op;
   }
 };
 
@@ -235,25 +862,87 @@ public:
 template<class T, class K, class V, class Base>
 class ShardedTableTMixin: public Base {
 private:
-  TableT<K, V>* getShard(const K& k) {
-    int shard = static_cast<T*>(this)->shardForKey(k);
+  int shardFor(const K& k) {
+    return static_cast<T*>(this)->shardForKey(k);
+  }
+
+  TableT<K, V>* typed(int shard) {
     return static_cast<TableT<K, V>*>(this->shard(shard));
   }
+
+  // Updates buffered by the current thread reach the table only when the
+  // map ends, so reading or overwriting the same table meanwhile would see
+  // them out of order.
+  void checkUnbuffered() {
+    UpdateBuffers* buffers = UpdateBuffers::current();
+    CHECK(buffers == NULL || buffers->find(this) == NULL)
+        << "Table " << this->id() << " read, put or removed after update() "
+        << "in the same map.";
+  }
+
+  // Writers wait for the maps running on a shard, so a map that wrote to
+  // its own table would wait for itself, or for a map waiting on it.
+  void checkNotMapped() {
+    UpdateBuffers* buffers = UpdateBuffers::current();
+    CHECK(buffers == NULL || buffers->mapped() != this)
+        << "Table " << this->id() << " put or removed by its own map.";
+  }
 public:
   void put(const K& k, const V& v) {
-    getShard(k)->put(k, v);
+    checkUnbuffered();
+    checkNotMapped();
+    int shard = shardFor(k);
+    ShardLock sl(this->shardLock(shard), true);
+    typed(shard)->put(k, v);
   }
 
   void update(const K& k, const V& v) {
-    getShard(k)->update(k, v);
+    UpdateBuffers* buffers = UpdateBuffers::current();
+    if (buffers != NULL) {
+      Table* b = buffers->find(this);
+      if (b == NULL) {
+        b = new SparseTable<K, V>(1, static_cast<T*>(this)->accumulator());
+        buffers->add(this, b, &applyBuffer);
+      }
+      static_cast<SparseTable<K, V>*>(b)->update(k, v);
+      return;
+    }
+
+    int shard = shardFor(k);
+    ShardLock sl(this->shardLock(shard), true);
+    typed(shard)->update(k, v);
   }
 
   bool contains(const K& k) {
-    return getShard(k)->contains(k);
+    checkUnbuffered();
+    int shard = shardFor(k);
+    ShardLock sl(this->shardLock(shard));
+    return typed(shard)->contains(k);
   }
 
   V get(const K& k) {
-    return getShard(k)->get(k);
+    checkUnbuffered();
+    int shard = shardFor(k);
+    ShardLock sl(this->shardLock(shard));
+    return typed(shard)->get(k);
+  }
+
+  Future<V> getAsync(const K& k) {
+    checkUnbuffered();
+    int shard = shardFor(k);
+    if (this->remote_[shard] == NULL) {
+      ShardLock sl(this->shardLock(shard));
+      return typed(shard)->getAsync(k);
+    }
+
+    // A cached value is returned at once by the default implementation.
+    RemoteTableT<K, V>* r =
+        static_cast<RemoteTableT<K, V>*>(this->shards_[shard]);
+    V v;
+    if (r->cached(k, &v)) {
+      return r->TableT<K, V>::getAsync(k);
+    }
+    return this->gets_[this->workerForShard(shard)]->add(shard, k);
   }
 
   int shardForKeyStr(StringPiece sp) {
@@ -261,43 +950,151 @@ public:
   }
 
   void remove(const K& k) {
-    getShard(k)->remove(k);
+    checkUnbuffered();
+    checkNotMapped();
+    int shard = shardFor(k);
+    ShardLock sl(this->shardLock(shard), true);
+    typed(shard)->remove(k);
   }
 
   TableIteratorT<K, V>* typedIterator() {
     return NULL;
   }
-};
 
-template<class K, class V>
-class RemoteTableT: public TypedTableMixin<K, V, RemoteTable> {
-public:
+  // The batched calls split the keys by shard and pass each group to that
+  // shard's own batched call, under a single lock.
+  void getMany(const K* keys, int count, V* out) {
+    checkUnbuffered();
+    std::vector<std::vector<int> > groups;
+    group(keys, count, &groups);
+    std::vector<K> k;
+    std::vector<V> v;
+    for (size_t shard = 0; shard < groups.size(); ++shard) {
+      const std::vector<int>& g = groups[shard];
+      if (g.empty()) {
+        continue;
+      }
+      gather(keys, g, &k);
+      v.resize(g.size());
+      {
+        ShardLock sl(this->shardLock(shard));
+        typed(shard)->getMany(&k[0], g.size(), &v[0]);
+      }
+      for (size_t i = 0; i < g.size(); ++i) {
+        out[g[i]] = v[i];
+      }
+    }
+  }
+
+  void containsMany(const K* keys, int count, bool* out) {
+    checkUnbuffered();
+    std::vector<std::vector<int> > groups;
+    group(keys, count, &groups);
+    std::vector<K> k;
+    boost::scoped_array<bool> found(new bool[count]);
+    for (size_t shard = 0; shard < groups.size(); ++shard) {
+      const std::vector<int>& g = groups[shard];
+      if (g.empty()) {
+        continue;
+      }
+      gather(keys, g, &k);
+      {
+        ShardLock sl(this->shardLock(shard));
+        typed(shard)->containsMany(&k[0], g.size(), found.get());
+      }
+      for (size_t i = 0; i < g.size(); ++i) {
+        out[g[i]] = found[i];
+      }
+    }
+  }
+
+  void updateMany(const K* keys, const V* values, int count) {
+    if (UpdateBuffers::current() != NULL) {
+      for (int i = 0; i < count; ++i) {
+        update(keys[i], values[i]);
+      }
+      return;
+    }
+
+    std::vector<std::vector<int> > groups;
+    group(keys, count, &groups);
+    std::vector<K> k;
+    std::vector<V> v;
+    for (size_t shard = 0; shard < groups.size(); ++shard) {
+      const std::vector<int>& g = groups[shard];
+      if (g.empty()) {
+        continue;
+      }
+      gather(keys, g, &k);
+      v.resize(g.size());
+      for (size_t i = 0; i < g.size(); ++i) {
+        v[i] = values[g[i]];
+      }
+      ShardLock sl(this->shardLock(shard), true);
+      typed(shard)->updateMany(&k[0], &v[0], g.size());
+    }
+  }
+
+private:
+  // Indices of 'keys' by the shard each belongs to.
+  void group(const K* keys, int count, std::vector<std::vector<int> >* out) {
+    out->resize(this->numShards());
+    for (int i = 0; i < count; ++i) {
+      (*out)[shardFor(keys[i])].push_back(i);
+    }
+  }
+
+  static void gather(const K* keys, const std::vector<int>& g,
+      std::vector<K>* out) {
+    out->resize(g.size());
+    for (size_t i = 0; i < g.size(); ++i) {
+      (*out)[i] = keys[g[i]];
+    }
+  }
+
+  static void applyBuffer(ShardedTable* dst, Table* buffer) {
+    TableT<K, V>* t = dynamic_cast<TableT<K, V>*>(dst);
+    typename SparseTable<K, V>::Iterator it(*static_cast<SparseTable<K, V>*>(buffer));
+    for (; !it.done(); it.Next()) {
+      t->update(it.key(), it.value());
+    }
+  }
 };
 
-template<class K, class V>
+// LocalTable is the table type used for shards owned by this worker;
+// it must provide a static create(numShards, accumulator), and set
+// kThreadSafe if concurrent kernels may use it without a shard lock.
+template<class K, class V, class LocalTable = SparseTable<K, V> >
 class ShardedTableT: public
-    ShardedTableTMixin<ShardedTableT<K, V>, K, V,
+    ShardedTableTMixin<ShardedTableT<K, V, LocalTable>, K, V,
     ShardedTableBaseMixin<K, V,
     UntypedTableMixin<K, V,
-    ShardedTableImpl<ShardedTableT<K, V>, K, V>>> > {
+    ShardedTableImpl<ShardedTableT<K, V, LocalTable>, K, V>>> > {
 public:
   int shardForKey(const K& k) {
-    return (*sharder_)(k, numShards_);
+    return (*sharder_)(k, this->numShards_);
   }
 
   Table* createLocal() {
-    return new SparseTable<K, V>;
+    return LocalTable::create(this->numShards_, accum_);
+  }
+
+  RemoteTableT<K, V>* createRemote(int shard) {
+    return new RemoteTableT<K, V>(this, shard, accum_);
   }
 
-  Table* createRemote() {
-    return new RemoteTableT<K, V>;
+  Accumulator<V>* accumulator() {
+    return accum_;
   }
 
-  ShardedTableT(int numShards, Sharder<K>* s, Accumulator<V>* a) :
-    numShards_(numShards_), sharder_(s), accum_(a) {
+  ShardedTableT(int id, int numShards, Sharder<K>* s, Accumulator<V>* a) :
+    sharder_(s), accum_(a) {
+    this->init(id, numShards);
+    // Incoming updates are applied on their own threads, so shards are
+    // always shared with the kernels.
+    this->lockShards_ = !LocalTable::kThreadSafe;
   }
 private:
-  int numShards_;
   Sharder<K>* sharder_;
   Accumulator<V>* accum_;
 };
@@ -305,7 +1102,29 @@ private:
 template<class K, class V>
 TableT<K, V>* TableRegistry::sparse(int numShards, Sharder<K>* sharding, Accumulator<V>* accum) {
   int tableId = tables.size();
-  ShardedTableT<K, V>* out = new ShardedTableT<K, V>(numShards, sharding, accum);
+  ShardedTableT<K, V>* out = new ShardedTableT<K, V>(tableId, numShards, sharding, accum);
+  tables[tableId] = out;
+  return out;
+}
+
+template<class K, class V>
+TableT<K, V>* TableRegistry::dense(int numShards, Sharder<K>* sharding, Accumulator<V>* accum) {
+  // Each shard assumes its keys share one residue modulo numShards.
+  CHECK(dynamic_cast<Sharding::Mod*>(sharding) != NULL ||
+        dynamic_cast<Sharding::UintMod*>(sharding) != NULL)
+      << "Dense tables must be sharded with Sharding::Mod or Sharding::UintMod.";
+  int tableId = tables.size();
+  ShardedTableT<K, V, DenseTable<K, V> >* out =
+      new ShardedTableT<K, V, DenseTable<K, V> >(tableId, numShards, sharding, accum);
+  tables[tableId] = out;
+  return out;
+}
+
+template<class K, class V>
+TableT<K, V>* TableRegistry::concurrent(int numShards, Sharder<K>* sharding, Accumulator<V>* accum) {
+  int tableId = tables.size();
+  ShardedTableT<K, V, ConcurrentSparseTable<K, V> >* out =
+      new ShardedTableT<K, V, ConcurrentSparseTable<K, V> >(tableId, numShards, sharding, accum);
   tables[tableId] = out;
   return out;
 }
@@ -3,13 +3,21 @@
 
 #include "util/common.h"
 #include "util/file.h"
+#include "util/hash.h"
 #include "util/marshal.h"
+#include "util/rpc.h"
 
+#include <boost/function.hpp>
 #include <boost/smart_ptr.hpp>
 #include <boost/thread.hpp>
 
+#include <map>
+#include <vector>
+
 #include "piccolo.pb.h"
 
+DECLARE_double(sleep_time);
+
 namespace piccolo {
 
 class Table;
@@ -17,7 +25,9 @@ class TableHelper;
 class TableData;
 
 static const int kReadAhead = 1024;
+static const int kPrefetchPages = 2;
 static const int kWriteFlushCount = 1000000;
+static const int kGetBatchSize = 256;
 
 typedef boost::function<Table* (void)> TableCreator;
 
@@ -68,12 +78,21 @@ struct Accumulators {
 };
 
 struct Sharding {
-  struct String: public Sharder<string> {
-    int operator()(const string& k, int shards) {
-      return StringPiece(k).hash() % shards;
+  // Shard on bits 24..55 of the key hash; SparseTable buckets come from the
+  // low bits, so keys that land in the same shard still spread across
+  // buckets.  The multiply-shift maps the bits onto [0, shards) without a
+  // division.
+  template<class K, class Hasher = Hash<K> >
+  struct Hashed: public Sharder<K> {
+    int operator()(const K& k, int shards) {
+      uint64_t bits = uint32_t(Hasher()(k) >> 24);
+      return (bits * shards) >> 32;
     }
   };
 
+  struct String: public Hashed<string> {
+  };
+
   struct Mod: public Sharder<int> {
     int operator()(const int& key, int shards) {
       return key % shards;
@@ -90,9 +109,42 @@ struct Sharding {
 struct TableCoder {
   virtual void write(StringPiece key, StringPiece value) = 0;
   virtual bool read(string* key, string* value) = 0;
+
+  // Packed blocks of fixed-size entries (see WriteBulk()).  Coders that
+  // cannot carry them return false, and the table falls back to writing
+  // entries one at a time.
+  virtual bool writeBulk(const StringPiece& block) {
+    return false;
+  }
+  virtual bool readBulk(StringPiece* block) {
+    return false;
+  }
+};
+
+// Encodings of a bulk block; see piccolo/table-coding.h.
+enum BulkFormat {
+  BULK_PACKED = 0,
+  BULK_DELTA = 1
+};
+
+// A bulk block is a BulkHeader followed by key_bytes of encoded keys and
+// then value_bytes of encoded values.
+struct BulkHeader {
+  uint32_t count;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t format;
+  uint32_t key_bytes;
+  uint32_t value_bytes;
+
+  int64_t bytes() const {
+    return sizeof(BulkHeader) + int64_t(key_bytes) + value_bytes;
+  }
 };
 
 struct TableIterator {
+  virtual ~TableIterator() {}
+
   virtual void keyStr(string *out) = 0;
   virtual void valueStr(string *out) = 0;
   virtual bool done() = 0;
@@ -129,6 +181,8 @@ protected:
 };
 
 struct TableBase {
+  virtual ~TableBase() {}
+
   virtual int32_t id() = 0;
   virtual int32_t numShards() = 0;
 
@@ -148,10 +202,137 @@ struct Table: public TableBase {
 
   virtual bool containsStr(const StringPiece& k) = 0;
   virtual string getStr(const StringPiece &k) = 0;
+  virtual void putStr(const StringPiece &k, const StringPiece &v) = 0;
   virtual void updateStr(const StringPiece &k, const StringPiece &v) = 0;
   virtual TableIterator* iterator() = 0;
+
+  // Apply a batch of updates, as sent by a remote shard's flush.  Local
+  // tables override this to decode bulk blocks as well.
+  virtual void applyUpdates(TableCoder* in) {
+    string k, v;
+    while (in->read(&k, &v)) {
+      updateStr(k, v);
+    }
+  }
+};
+
+template<class V>
+struct FutureState {
+  FutureState() :
+      ready(false), found(false) {
+  }
+
+  volatile bool ready;
+  bool found;
+  V value;
+
+  // Makes progress towards 'ready' without blocking; unset once ready.
+  boost::function<void ()> poll;
+};
+
+// A value requested with TableT::getAsync().
+template<class V>
+class Future {
+public:
+  Future(boost::shared_ptr<FutureState<V> > s) :
+      s_(s) {
+  }
+
+  // True once the value (or its absence) is known.  Never blocks.
+  bool ready() {
+    if (!s_->ready) {
+      CHECK(!s_->poll.empty()) << "Table deleted while a get was pending.";
+      s_->poll();
+    }
+    return s_->ready;
+  }
+
+  // Block until ready(), and return whether the key was present.
+  bool wait() {
+    rpc::NetworkThread* net = rpc::NetworkThread::Get();
+    while (true) {
+      uint64_t seen = net->arrivals();
+      if (ready()) {
+        return s_->found;
+      }
+      net->WaitForArrival(seen, FLAGS_sleep_time);
+    }
+  }
+
+  const V& get() {
+    CHECK(wait()) << "No entry for requested key";
+    return s_->value;
+  }
+
+private:
+  boost::shared_ptr<FutureState<V> > s_;
+};
+
+// The lock of a local shard whose table is not itself thread-safe.  It is
+// held for single operations, and by a map only while it copies a batch
+// of values out of the shard and back (see MapKernel), so gets and
+// iterators from other workers are served between batches.  Writes could
+// move the entries a map has in hand, so writers also wait until the
+// shard is no longer being mapped.
+//
+// Waiters block rather than spin: an apply thread may hold the lock for a
+// whole put batch, and the network thread must not burn a core meanwhile.
+class ShardMutex: private boost::noncopyable {
+public:
+  ShardMutex() :
+      mapped_(false) {
+  }
+
+  void lock() {
+    mutex_.lock();
+  }
+  void unlock() {
+    mutex_.unlock();
+  }
+
+  // lock(), once no map is running on the shard.
+  void lockForWrite();
+
+  void beginMap();
+  void endMap();
+
+  // True while a map is running on the shard.
+  bool mapped();
+
+private:
+  boost::mutex mutex_;
+  bool mapped_;
+  boost::condition_variable_any unmapped_;
 };
 
+// Holds a shard lock, if there is one, for the current scope.
+class ShardLock: private boost::noncopyable {
+public:
+  ShardLock(ShardMutex* l, bool write = false) :
+      l_(l) {
+    if (l_ == NULL) {
+      return;
+    }
+    if (write) {
+      l_->lockForWrite();
+    } else {
+      l_->lock();
+    }
+  }
+
+  ~ShardLock() {
+    if (l_ != NULL) {
+      l_->unlock();
+    }
+  }
+
+private:
+  ShardMutex* l_;
+};
+
+template<class K, class V> struct MapNone;
+template<class K, class V, class Stages> class MapPipeline;
+
 // Key/value typed interface.
 template<class K, class V>
 class TableT: public Table {
@@ -180,39 +361,139 @@ public:
   virtual void remove(const K &k) = 0;
   virtual TypedIter* typedIterator() = 0;
 
+  // Split iteration into at most 'count' iterators that together visit
+  // every entry once, so that a scan can be divided between threads.  The
+  // caller owns the iterators.
+  virtual void typedIterators(int count, std::vector<TypedIter*>* out) {
+    out->push_back(typedIterator());
+  }
+
+  // An iterator over part of a local table, and the lock guarding it.
+  struct LockedRange {
+    ShardMutex* lock;
+    TypedIter* iter;
+  };
+
+  // Split a local table, whose shard lock is 'lock', into ranges for
+  // MapKernel, using up to 'count' iterators where the table can be split.
+  // Each lock returned has been marked mapped (see ShardMutex::beginMap());
+  // the caller ends the map on each.  Thread-safe tables return ranges
+  // under their own internal locks.
+  virtual void lockedRanges(ShardMutex* lock, int count,
+      std::vector<LockedRange>* out) {
+    lock->beginMap();
+    ShardLock sl(lock);
+    std::vector<TypedIter*> iters;
+    if (count > 1) {
+      typedIterators(count, &iters);
+    } else {
+      iters.push_back(typedIterator());
+    }
+    for (size_t i = 0; i < iters.size(); ++i) {
+      LockedRange r = { lock, iters[i] };
+      out->push_back(r);
+    }
+  }
+
+  // Batched operations on 'count' keys.  These default to looping over the
+  // single-key calls; local tables override them to overlap the cache
+  // misses of a batch.
+  virtual void getMany(const K* keys, int count, V* out) {
+    for (int i = 0; i < count; ++i) {
+      out[i] = get(keys[i]);
+    }
+  }
+
+  virtual void containsMany(const K* keys, int count, bool* out) {
+    for (int i = 0; i < count; ++i) {
+      out[i] = contains(keys[i]);
+    }
+  }
+
+  virtual void updateMany(const K* keys, const V* values, int count) {
+    for (int i = 0; i < count; ++i) {
+      update(keys[i], values[i]);
+    }
+  }
+
+  // Start fetching the value for 'k' and return without waiting for it.
+  // Local tables answer immediately; sharded tables send the gets for
+  // each remote worker together (see RemoteGetBatch).
+  virtual Future<V> getAsync(const K& k) {
+    boost::shared_ptr<FutureState<V> > s(new FutureState<V>);
+    s->found = contains(k);
+    if (s->found) {
+      s->value = get(k);
+    }
+    s->ready = true;
+    return Future<V>(s);
+  }
+
   // Untyped operations
   virtual bool containsStr(const StringPiece& k) = 0;
   virtual string getStr(const StringPiece &k) = 0;
+  virtual void putStr(const StringPiece &k, const StringPiece &v) = 0;
   virtual void updateStr(const StringPiece &k, const StringPiece &v) = 0;
   virtual TableIterator* iterator() = 0;
 
+  // Run a kernel on every shard of this sharded table, each on the worker
+  // that owns it, and return once all have finished and their updates
+  // have been applied.  Only the master may start kernels.
+  //
+  // map() calls MapFunction on every entry of a shard; run() calls
+  // RunFunction, and runKernel() a method of a new KernelClass, once per
+  // shard.  These are defined in kernel.h.
   template<void (*MapFunction)(const K&, V&)>
-  void map() {
+  void map();
 
-  }
+  // Fuse several map functions into one kernel, which passes each entry
+  // through all of them in turn:
+  //
+  //   table->pipeline().map<A>().map<B>().run();
+  MapPipeline<K, V, MapNone<K, V> > pipeline();
 
   template<void (*RunFunction)(TableT<K, V>*, int)>
-  void run() {
+  void run();
 
-  }
-
-  template<class KernelClass, void (KernelClass::*)(TableT<K, V>*, int)>
-  void runKernel() {
-
-  }
+  template<class KernelClass, void (KernelClass::*Method)(TableT<K, V>*, int)>
+  void runKernel();
 protected:
 };
 
 class ShardedTable {
 public:
+  virtual ~ShardedTable() {}
+
   virtual int32_t id() = 0;
   virtual int32_t numShards() = 0;
 
+  // Called once in each process, before any shard is assigned.  The
+  // master, which owns no shards, passes -1.
+  virtual void setWorkerId(int worker) = 0;
+
+  // Record 'worker' as the owner of 'shard'.  On a worker this also moves
+  // the shard between a local table and a remote update buffer as needed.
+  virtual void assignShard(int shard, int worker) = 0;
+
+  // Send all buffered updates for remote shards to their owners, and
+  // return the number of entries sent.
+  virtual int64_t flush() = 0;
+
+  // Remote values cached by this worker are valid only within one epoch.
+  // The worker advances the epoch when a kernel starts and when the table
+  // is cleared or swapped.
+  virtual int epoch() = 0;
+  virtual void advanceEpoch() = 0;
+
   virtual Table* shard(int shard) = 0;
   virtual ShardInfo* shardInfo(int shard) = 0;
   virtual int64_t shardSize(int shard) = 0;
   virtual void updateShards(const ShardInfo& sinfo) = 0;
 
+  // The lock to hold while using local shard 'shard' from more than one
+  // thread, or NULL if its table is safe for concurrent use.
+  virtual ShardMutex* shardLock(int shard) = 0;
+
   virtual bool isLocalShard(int shard) = 0;
   virtual bool isLocalKey(const StringPiece &k) = 0;
   virtual int workerForShard(int shard) = 0;
@@ -220,6 +501,56 @@ public:
   virtual int shardForKeyStr(StringPiece) = 0;
 };
 
+// Clear, swap and reserve calls made on the master are queued, and
+// broadcast to the workers as one batch just before the master next sends
+// them anything else: table data, a read or a kernel.  Both are defined in
+// master.cc; SendTableControl() does nothing outside the master.
+void QueueTableControl(const TableControl::Op& op);
+void SendTableControl();
+
+// Per-thread buffers for update()s to sharded tables.  While a thread has
+// a current set, each ShardedTableT combines its updates into a private
+// buffer instead of locking the shard; flush() then applies every buffer
+// to its table.  Used by MapKernel, whose threads run map functions
+// without holding the shard lock.
+// Only update() is buffered: a table updated by the current thread may not
+// also be read, put to or removed from until the buffers are flushed, and
+// ShardedTableT CHECKs this.
+class UpdateBuffers: private boost::noncopyable {
+public:
+  typedef void (*ApplyFunction)(ShardedTable* dst, Table* buffer);
+
+  // 'mapped' is the table whose shard the owning map runs over.
+  explicit UpdateBuffers(ShardedTable* mapped) :
+      mapped_(mapped) {
+  }
+  ~UpdateBuffers();
+
+  static UpdateBuffers* current();
+  static void setCurrent(UpdateBuffers* b);
+
+  ShardedTable* mapped() const {
+    return mapped_;
+  }
+
+  // Return the buffer for 't', or NULL if it has none yet.
+  Table* find(ShardedTable* t);
+  void add(ShardedTable* t, Table* buffer, ApplyFunction apply);
+
+  // Apply and discard all buffers.  Called from a thread without a current
+  // set, so the updates reach the tables.
+  void flush();
+
+private:
+  struct Buffer {
+    Table* table;
+    ApplyFunction apply;
+  };
+
+  ShardedTable* mapped_;
+  std::map<ShardedTable*, Buffer> buffers_;
+};
+
 template<class K, class V>
 class ProxyTableT: public TableT<K, V> {
 public:
@@ -239,6 +570,16 @@ public:
 
   template<class K, class V>
   static TableT<K, V>* sparse(int numShards, Sharder<K>* sharding, Accumulator<V>* accum);
+
+  // A table for dense integer keys sharded with Sharding::Mod; each shard
+  // is a DenseTable indexed directly by key.
+  template<class K, class V>
+  static TableT<K, V>* dense(int numShards, Sharder<K>* sharding, Accumulator<V>* accum);
+
+  // Like sparse(), but local shards are ConcurrentSparseTables and may be
+  // accessed by several kernel threads at once.
+  template<class K, class V>
+  static TableT<K, V>* concurrent(int numShards, Sharder<K>* sharding, Accumulator<V>* accum);
 private:
 };
 
@@ -3,11 +3,13 @@
 
 #include "util/common.h"
 #include "util/rpc.h"
+#include "util/timer.h"
 #include "piccolo/kernel.h"
 #include "piccolo/table.h"
 #include "piccolo.pb.h"
 
 #include <boost/thread.hpp>
+#include <deque>
 #include <map>
 #include <mpi.h>
 
@@ -31,6 +33,9 @@ public:
   void Run();
 
   void KernelLoop();
+  void KernelThread();
+  void RunKernel(const KernelRequest& kreq);
+  void ApplyThread(int index);
   void TableLoop();
   Stats get_stats() {
     return stats_;
@@ -41,22 +46,24 @@ public:
 
   void HandleGetRequest(const HashGet& get_req, TableData *get_resp,
       const rpc::RPCInfo& rpc);
-  void HandleSwapRequest(const SwapTable& req, EmptyMessage *resp,
-      const rpc::RPCInfo& rpc);
-  void HandleClearRequest(const ClearTable& req, EmptyMessage *resp,
+  void HandleTableControl(const TableControl& req, EmptyMessage *resp,
       const rpc::RPCInfo& rpc);
   void HandleIteratorRequest(const IteratorRequest& iterator_req,
       IteratorResponse *iterator_resp, const rpc::RPCInfo& rpc);
   void HandleShardAssignment(const ShardAssignmentRequest& req,
       EmptyMessage *resp, const rpc::RPCInfo& rpc);
 
+  // Queue incoming put batches for the apply threads.
   void HandlePutRequest();
+  void ApplyPut(TableData* put);
+
+  // Wait until every batch queued so far has been applied.
+  void WaitForApply();
 
-  // Barrier: wait until all table data is transmitted.
+  // Barrier: flush this worker and its subtree, and count the put
+  // batches they have sent and applied.
   void HandleFlush(const EmptyMessage& req, FlushResponse *resp,
       const rpc::RPCInfo& rpc);
-  void HandleApply(const EmptyMessage& req, EmptyMessage *resp,
-      const rpc::RPCInfo& rpc);
   void HandleFinalize(const EmptyMessage& req, EmptyMessage *resp,
       const rpc::RPCInfo& rpc);
   void HandleStartRestore(const StartRestore& req, EmptyMessage *resp,
@@ -91,6 +98,35 @@ private:
   bool kernelRunning_;
   bool handlingPuts_;
 
+  // Kernel requests waiting for a thread of the kernel pool.
+  boost::mutex kernel_lock_;
+  boost::condition_variable kernel_cond_;
+  std::deque<KernelRequest> kernel_queue_;
+  int kernels_active_;
+  Timer idle_;
+
+  // Put batches received for one local shard.  They are applied in order
+  // by the apply thread that owns the shard, but never while a kernel is
+  // running on it.
+  struct ShardQueue {
+    std::deque<TableData*> batches;
+    bool applying;
+    bool kernel;
+
+    ShardQueue() :
+        applying(false), kernel(false) {
+    }
+  };
+  typedef std::pair<int, int> ShardId;
+
+  boost::mutex apply_lock_;
+  boost::condition_variable apply_cond_;
+  std::map<ShardId, ShardQueue> apply_queues_;
+  int64_t apply_pending_;
+
+  // Put batches received and applied, or passed on, since startup.
+  int64_t apply_done_;
+
   ConfigData config_;
 
   // The status of other workers.
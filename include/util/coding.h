@@ -0,0 +1,50 @@
+#ifndef UTIL_CODING_H_
+#define UTIL_CODING_H_
+
+#include "glog/logging.h"
+
+#include <stdint.h>
+#include <string>
+
+namespace piccolo {
+
+// Little-endian base-128 varints, as used by protocol buffers.
+inline void PutVarint64(uint64_t v, std::string* out) {
+  char buf[10];
+  int n = 0;
+  while (v >= 0x80) {
+    buf[n++] = char(v | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = char(v);
+  out->append(buf, n);
+}
+
+// Decode a varint from [*p, end) and advance *p past it.
+inline uint64_t GetVarint64(const char** p, const char* end) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    CHECK_LT(*p, end) << "Truncated varint.";
+    uint8_t b = *(*p)++;
+    v |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return v;
+    }
+  }
+  LOG(FATAL) << "Malformed varint.";
+  return 0;
+}
+
+// Map signed values onto unsigned ones so small magnitudes of either sign
+// have short varints.
+inline uint64_t ZigZag(int64_t v) {
+  return (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+}
+
+inline int64_t UnZigZag(uint64_t v) {
+  return int64_t(v >> 1) ^ -int64_t(v & 1);
+}
+
+}
+
+#endif /* UTIL_CODING_H_ */
@@ -2,64 +2,99 @@
 #define UTIL_HASH_H_
 
 #include <stdint.h>
-
-// Code from: http://www.azillionmonkeys.com/qed/hash.html
-#undef get16bits
-#if (defined(__GNUC__) && defined(__i386__)) || defined(__WATCOMC__) \
-  || defined(_MSC_VER) || defined (__BORLANDC__) || defined (__TURBOC__)
-#define get16bits(d) (*((const uint16_t *) (d)))
-#endif
-
-#if !defined (get16bits)
-#define get16bits(d) ((((uint32_t)(((const uint8_t *)(d))[1])) << 8)\
-                       +(uint32_t)(((const uint8_t *)(d))[0]) )
-#endif
+#include <string.h>
+#include <limits>
+#include <string>
+#include <boost/functional/hash.hpp>
+#include <boost/type_traits.hpp>
+#include <boost/utility/enable_if.hpp>
 
 namespace piccolo {
-static uint32_t SuperFastHash (const char * data, int len) {
-uint32_t hash = len, tmp;
-int rem;
 
-    if (len <= 0 || data == NULL) return 0;
+// Final avalanche step from MurmurHash3.
+static inline uint64_t MixHash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
 
-    rem = len & 3;
-    len >>= 2;
+// Hash a byte range a word at a time.
+static inline uint64_t HashBytes(const char* data, size_t len) {
+  static const uint64_t kMul = 0x9e3779b97f4a7c15ULL;
+  uint64_t h = kMul ^ len;
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t w;
+    memcpy(&w, data, 8);
+    h = (h ^ MixHash(w)) * kMul;
+  }
+  if (len > 0) {
+    uint64_t w = 0;
+    memcpy(&w, data, len);
+    h = (h ^ MixHash(w)) * kMul;
+  }
+  return MixHash(h);
+}
 
-    /* Main loop */
-    for (;len > 0; len--) {
-        hash  += get16bits (data);
-        tmp    = (get16bits (data+2) << 11) ^ hash;
-        hash   = (hash << 16) ^ tmp;
-        data  += 2*sizeof (uint16_t);
-        hash  += hash >> 11;
-    }
+// Hash policies for tables and sharders.  Every policy returns a fully
+// mixed 64-bit value: SparseTable takes the bucket from the low bits and
+// its control tag from the top 7, Sharding::Hashed takes the shard from
+// the bits in between, so neither choice is correlated with the other.
+//
+// The default handles any type boost::hash accepts, including types with
+// a hash_value() overload.
+template<class T, class Enable = void>
+struct Hash {
+  uint64_t operator()(const T& t) const {
+    return MixHash(boost::hash<T>()(t));
+  }
+};
+
+template<class T>
+struct Hash<T, typename boost::enable_if<boost::is_integral<T> >::type> {
+  uint64_t operator()(const T& t) const {
+    return MixHash(static_cast<uint64_t>(t));
+  }
+};
 
-    /* Handle end cases */
-    switch (rem) {
-        case 3: hash += get16bits (data);
-                hash ^= hash << 16;
-                hash ^= data[sizeof (uint16_t)] << 18;
-                hash += hash >> 11;
-                break;
-        case 2: hash += get16bits (data);
-                hash ^= hash << 11;
-                hash += hash >> 17;
-                break;
-        case 1: hash += *data;
-                hash ^= hash << 10;
-                hash += hash >> 1;
+// Floating keys that compare equal must hash equal, so -0.0 is hashed as
+// 0.0 and every NaN alike.  Widening to double also leaves out the
+// padding of long double.
+template<class T>
+struct Hash<T,
+    typename boost::enable_if<boost::is_floating_point<T> >::type> {
+  uint64_t operator()(const T& t) const {
+    double d = t;
+    if (d == 0) {
+      d = 0;
+    } else if (d != d) {
+      d = std::numeric_limits<double>::quiet_NaN();
     }
+    uint64_t w;
+    memcpy(&w, &d, sizeof(w));
+    return MixHash(w);
+  }
+};
 
-    /* Force "avalanching" of final 127 bits */
-    hash ^= hash << 3;
-    hash += hash >> 5;
-    hash ^= hash << 4;
-    hash += hash >> 17;
-    hash ^= hash << 25;
-    hash += hash >> 6;
+// Other POD keys hash their bytes, so they must not contain uninitialized
+// padding.
+template<class T>
+struct Hash<T, typename boost::enable_if_c<boost::is_pod<T>::value &&
+    !boost::is_integral<T>::value &&
+    !boost::is_floating_point<T>::value>::type> {
+  uint64_t operator()(const T& t) const {
+    return HashBytes(reinterpret_cast<const char*>(&t), sizeof(T));
+  }
+};
 
-    return hash;
-}
+template<>
+struct Hash<std::string> {
+  uint64_t operator()(const std::string& s) const {
+    return HashBytes(s.data(), s.size());
+  }
+};
 }
 
 #endif /* HASH_H_ */
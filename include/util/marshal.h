@@ -7,20 +7,32 @@
 #include <boost/type_traits.hpp>
 #include <boost/utility.hpp>
 #include <string>
+#include <utility>
 
 namespace piccolo {
 
 struct MarshalBase {};
 
+// Marshal<T> converts values to and from bytes.  marshal() replaces the
+// contents of 'out'; the built-in encodings also provide append(), which
+// adds to the end of 'out' so that many values can share one buffer (see
+// marshalAppend()).  Specializations need only marshal() and unmarshal().
 template <class T, class Enable = void>
 struct Marshal : public MarshalBase {
-  virtual ~Marshal() {}
-  virtual void marshal(const T& t, std::string* out) {
+  // Marks the default encoding: the raw bytes of a POD value.
+  typedef void RawBytes;
+
+  void marshal(const T& t, std::string* out) {
+    out->clear();
+    append(t, out);
+  }
+
+  void append(const T& t, std::string* out) {
     GOOGLE_GLOG_COMPILE_ASSERT(boost::is_pod<T>::value, Invalid_Value_Type);
-    out->assign(reinterpret_cast<const char*>(&t), sizeof(t));
+    out->append(reinterpret_cast<const char*>(&t), sizeof(t));
   }
 
-  virtual void unmarshal(const StringPiece& s, T *t) {
+  void unmarshal(const StringPiece& s, T *t) {
     GOOGLE_GLOG_COMPILE_ASSERT(boost::is_pod<T>::value, Invalid_Value_Type);
     *t = *reinterpret_cast<const T*>(s.data);
   }
@@ -29,15 +41,40 @@ struct Marshal : public MarshalBase {
 template <class T>
 struct Marshal<T, typename boost::enable_if<boost::is_base_of<std::string, T> >::type> : public MarshalBase {
   void marshal(const std::string& t, std::string *out) { *out = t; }
+  void append(const std::string& t, std::string *out) { out->append(t); }
   void unmarshal(const StringPiece& s, std::string *t) { t->assign(s.data, s.len); }
 };
 
 template <class T>
 struct Marshal<T, typename boost::enable_if<boost::is_base_of<google::protobuf::Message, T> >::type> : public MarshalBase {
   void marshal(const google::protobuf::Message& t, std::string *out) { t.SerializePartialToString(out); }
+  void append(const google::protobuf::Message& t, std::string *out) { t.AppendPartialToString(out); }
   void unmarshal(const StringPiece& s, google::protobuf::Message* t) { t->ParseFromArray(s.data, s.len); }
 };
 
+// True if Marshal<T> has an append() method.
+template <class T>
+struct HasMarshalAppend {
+  template <class M> static char check(decltype(std::declval<M&>().append(
+      std::declval<const T&>(), (std::string*) NULL))*);
+  template <class M> static long check(...);
+  static const bool value = sizeof(check<Marshal<T> >(0)) == 1;
+};
+
+// True if T is a POD marshalled as its raw bytes, so arrays of T can be
+// copied in bulk.  PODs with their own Marshal specialization are excluded.
+template <class T, bool Pod = boost::is_pod<T>::value>
+struct IsRawMarshal {
+  static const bool value = false;
+};
+
+template <class T>
+struct IsRawMarshal<T, true> {
+  template <class M> static char check(typename M::RawBytes*);
+  template <class M> static long check(...);
+  static const bool value = sizeof(check<Marshal<T> >(0)) == 1;
+};
+
 template <class T>
 void marshal(const T& t, std::string* out) {
   Marshal<T> m;
@@ -52,6 +89,27 @@ std::string marshal(const T& t) {
   return out;
 }
 
+template <class T>
+void marshalAppend(const T& t, std::string* out, boost::true_type) {
+  Marshal<T> m;
+  m.append(t, out);
+}
+
+// Specializations without append() marshal into a scratch buffer first.
+template <class T>
+void marshalAppend(const T& t, std::string* out, boost::false_type) {
+  std::string scratch;
+  Marshal<T> m;
+  m.marshal(t, &scratch);
+  out->append(scratch);
+}
+
+// Append the encoding of 't' to 'out', leaving its current contents intact.
+template <class T>
+void marshalAppend(const T& t, std::string* out) {
+  marshalAppend(t, out, boost::integral_constant<bool, HasMarshalAppend<T>::value>());
+}
+
 
 template <class T>
 T unmarshal(const StringPiece& s) {
@@ -67,6 +125,35 @@ void unmarshal(const StringPiece& s, T* v) {
   m.unmarshal(s, v);
 }
 
+// A view of an encoded value that does not copy it: a reference into the
+// buffer for raw-marshalled PODs, and the bytes themselves for strings.
+// The view is only valid as long as the buffer is.
+template <class T, class Enable = void>
+struct MarshalView {
+};
+
+template <class T>
+struct MarshalView<T, typename boost::enable_if_c<IsRawMarshal<T>::value>::type> {
+  typedef const T& type;
+  static type view(const StringPiece& s) {
+    DCHECK_EQ(s.len, sizeof(T));
+    return *reinterpret_cast<const T*>(s.data);
+  }
+};
+
+template <class T>
+struct MarshalView<T, typename boost::enable_if<boost::is_base_of<std::string, T> >::type> {
+  typedef StringPiece type;
+  static type view(const StringPiece& s) {
+    return s;
+  }
+};
+
+template <class T>
+typename MarshalView<T>::type unmarshalView(const StringPiece& s) {
+  return MarshalView<T>::view(s);
+}
+
 }
 
 #endif /* MARSHAL_H_ */
@@ -0,0 +1,210 @@
+#ifndef UTIL_MEMORY_H_
+#define UTIL_MEMORY_H_
+
+#include "util/common.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/type_traits.hpp>
+
+#include <new>
+#include <stddef.h>
+#include <vector>
+
+namespace piccolo {
+
+// Where a large allocation ended up.
+enum MemoryBacking {
+  MEM_HEAP = 0,
+  MEM_MMAP = 1,
+  MEM_TRANSPARENT_HUGE = 2,
+  MEM_HUGETLB = 3
+};
+
+const char* MemoryBackingName(MemoryBacking b);
+
+// Allocate 'bytes' of zeroed memory.  Allocations of at least
+// --hugepage_threshold bytes are mmap'd and backed by huge pages where the
+// kernel allows it (explicit MAP_HUGETLB pages first if --hugetlb is set,
+// then transparent huge pages); otherwise they fall back to plain pages and
+// finally the heap.  The backing actually used is stored in '*backing'.
+void* AllocateLarge(size_t bytes, MemoryBacking* backing);
+void FreeLarge(void* p, size_t bytes, MemoryBacking backing);
+
+// A fixed-size array allocated with AllocateLarge.  Unlike std::vector it
+// never copies on growth: allocate() discards the previous contents.
+template<class T>
+class LargeArray: private boost::noncopyable {
+public:
+  LargeArray() :
+      data_(NULL), size_(0), backing_(MEM_HEAP) {
+  }
+
+  ~LargeArray() {
+    release();
+  }
+
+  // Allocate 'n' default-constructed elements.  Memory comes back zeroed,
+  // which is already a valid value for trivially constructible types.
+  void allocate(size_t n) {
+    release();
+    data_ = static_cast<T*>(AllocateLarge(n * sizeof(T), &backing_));
+    size_ = n;
+    if (!boost::has_trivial_default_constructor<T>::value) {
+      for (size_t i = 0; i < n; ++i) {
+        new (data_ + i) T();
+      }
+    }
+  }
+
+  void release() {
+    if (data_ == NULL) {
+      return;
+    }
+    if (!boost::has_trivial_destructor<T>::value) {
+      for (size_t i = 0; i < size_; ++i) {
+        data_[i].~T();
+      }
+    }
+    FreeLarge(data_, size_ * sizeof(T), backing_);
+    data_ = NULL;
+    size_ = 0;
+  }
+
+  void swap(LargeArray<T>& o) {
+    std::swap(data_, o.data_);
+    std::swap(size_, o.size_);
+    std::swap(backing_, o.backing_);
+  }
+
+  T& operator[](size_t i) {
+    return data_[i];
+  }
+  const T& operator[](size_t i) const {
+    return data_[i];
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  MemoryBacking backing() const {
+    return backing_;
+  }
+
+private:
+  T* data_;
+  size_t size_;
+  MemoryBacking backing_;
+};
+
+// A slab allocator for objects of type T.  Objects are constructed once, in
+// blocks, and then recycled: release() returns an object to a free list and
+// reset() makes every object available again in O(1).  Objects are not
+// destroyed until the arena is, so a recycled string or buffer keeps its
+// storage and reassigning it usually does not allocate.
+template<class T>
+class Arena: private boost::noncopyable {
+public:
+  Arena() :
+      used_(0), constructed_(0) {
+  }
+
+  ~Arena() {
+    for (int64_t i = 0; i < constructed_; ++i) {
+      at(i)->~T();
+    }
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      ::operator delete(blocks_[i]);
+    }
+  }
+
+  // Return an object holding an unspecified (previously assigned) value.
+  T* alloc() {
+    if (!free_.empty()) {
+      T* t = free_.back();
+      free_.pop_back();
+      return t;
+    }
+
+    if (used_ == (int64_t) blocks_.size() * kBlockSize) {
+      blocks_.push_back(static_cast<T*>(::operator new(kBlockSize * sizeof(T))));
+    }
+    T* t = at(used_);
+    if (used_ == constructed_) {
+      new (t) T();
+      ++constructed_;
+    }
+    ++used_;
+    return t;
+  }
+
+  void release(T* t) {
+    free_.push_back(t);
+  }
+
+  void reset() {
+    free_.clear();
+    used_ = 0;
+  }
+
+  void swap(Arena<T>& o) {
+    blocks_.swap(o.blocks_);
+    free_.swap(o.free_);
+    std::swap(used_, o.used_);
+    std::swap(constructed_, o.constructed_);
+  }
+
+private:
+  static const int64_t kBlockSize = 256;
+
+  T* at(int64_t i) {
+    return blocks_[i / kBlockSize] + i % kBlockSize;
+  }
+
+  std::vector<T*> blocks_;
+  std::vector<T*> free_;
+
+  // Objects [0, used_) have been handed out since the last reset();
+  // objects [0, constructed_) are live.
+  int64_t used_;
+  int64_t constructed_;
+};
+
+// How a table stores a value of type V inside its slot array.  POD values
+// are stored inline.  Anything else (strings, protocol buffers, structures
+// owning heap buffers) lives in an Arena, and the slot holds a pointer to it:
+// rehashing moves just the pointer, and clearing the table recycles every
+// value without freeing it.
+template<class V, bool Boxed = !boost::is_pod<V>::value>
+struct ValueSlot {
+  V v;
+
+  V& get() {
+    return v;
+  }
+  void store(Arena<V>* arena, const V& x) {
+    v = x;
+  }
+  void release(Arena<V>* arena) {
+  }
+};
+
+template<class V>
+struct ValueSlot<V, true> {
+  V* p;
+
+  V& get() {
+    return *p;
+  }
+  void store(Arena<V>* arena, const V& x) {
+    p = arena->alloc();
+    *p = x;
+  }
+  void release(Arena<V>* arena) {
+    arena->release(p);
+  }
+};
+
+}
+
+#endif /* UTIL_MEMORY_H_ */
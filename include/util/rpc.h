@@ -41,10 +41,21 @@ public:
   bool active() const;
   int64_t pending_bytes() const;
 
-  // Blocking read for the given source and message type.
+  // Blocking read for the given source and message type.  Blocking calls
+  // sleep until the network thread queues a message of their type, rather
+  // than polling.
   void Read(int desired_src, int type, Message* data, int *source=NULL);
   bool TryRead(int desired_src, int type, Message* data, int *source=NULL);
 
+  // A count of the messages received so far.  To wait for a condition that
+  // depends on incoming messages, read arrivals(), test the condition, and
+  // then call WaitForArrival() with the count read.
+  uint64_t arrivals() const { return arrivals_; }
+
+  // Block until a message arrives after arrivals() returned 'seen', or
+  // 'timeout' seconds pass.
+  void WaitForArrival(uint64_t seen, double timeout);
+
   // Enqueue the given request for transmission.
   void Send(RPCRequest *req);
   void Send(int dst, int method, const Message &msg);
@@ -56,6 +67,10 @@ public:
   // Invoke 'method' on the destination, and wait for a reply.
   void Call(int dst, int method, const Message &msg, Message *reply);
 
+  // Read the next reply from 'src' to a 'method' request.
+  void ReadReply(int src, int method, Message *reply);
+  bool TryReadReply(int src, int method, Message *reply);
+
   void Flush();
   void Shutdown();
 
@@ -99,7 +114,8 @@ private:
 
   CallbackInfo* callbacks_[kMaxMethods];
 
-  std::vector<RPCRequest*> pending_sends_;
+  // Sent in order, so requests to one destination arrive in order.
+  std::deque<RPCRequest*> pending_sends_;
   std::tr1::unordered_set<RPCRequest*> active_sends_;
 
   Queue requests[kMaxMethods][kMaxHosts];
@@ -108,6 +124,14 @@ private:
   MPI::Comm *world_;
   mutable boost::recursive_mutex send_lock;
   mutable boost::recursive_mutex q_lock[kMaxHosts];
+
+  // Readers blocked on a message type wait on its condition; other
+  // waiters and the network thread itself, when idle, on their own.
+  boost::mutex wait_lock_;
+  boost::condition_variable arrived_[kMaxMethods];
+  boost::condition_variable any_arrived_;
+  boost::condition_variable send_queued_;
+  volatile uint64_t arrivals_;
   mutable boost::thread *t_;
   int id_;
 
@@ -115,6 +139,8 @@ private:
   bool check_request_queue(int src, int type, Message* data);
 
   void InvokeCallback(CallbackInfo *ci, RPCInfo rpc);
+  void NotifyArrival(int type);
+  void WaitForWork();
   void CollectActive();
   void Run();
 
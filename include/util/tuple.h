@@ -105,7 +105,7 @@ struct hash<piccolo::tuple2<A, B> > : public unary_function<piccolo::tuple2<A, B
 
   size_t operator()(const piccolo::tuple2<A, B> & k) const {
     size_t res[] = { ha(k.a_), hb(k.b_) };
-    return piccolo::SuperFastHash((char*)&res, sizeof(res));
+    return piccolo::HashBytes((char*)&res, sizeof(res));
   }
 };
 
@@ -117,7 +117,7 @@ struct hash<piccolo::tuple3<A, B, C> > : public unary_function<piccolo::tuple3<A
 
   size_t operator()(const piccolo::tuple3<A, B, C> & k) const {
     size_t res[] = { ha(k.a_), hb(k.b_), hc(k.c_) };
-    return piccolo::SuperFastHash((char*)&res, sizeof(res));
+    return piccolo::HashBytes((char*)&res, sizeof(res));
   }
 };
 
@@ -35,11 +35,11 @@ struct ClusterAccum: public Accumulator<Cluster> {
 
 struct KMeans {
   void setup(const ConfigData& conf) {
-    clusters = TableRegistry::sparse(conf.num_workers() * 4, new Sharding::Mod,
+    clusters = TableRegistry::dense(conf.num_workers() * 4, new Sharding::Mod,
         new ClusterAccum);
-    points = TableRegistry::sparse(conf.num_workers() * 4, new Sharding::Mod,
+    points = TableRegistry::dense(conf.num_workers() * 4, new Sharding::Mod,
         new Accumulators<Point>::Replace);
-    actual = TableRegistry::sparse(conf.num_workers() * 4, new Sharding::Mod,
+    actual = TableRegistry::dense(conf.num_workers() * 4, new Sharding::Mod,
         new Accumulators<Cluster>::Replace);
   }
 
@@ -52,10 +52,19 @@ struct KMeans {
     }
   }
 
+  // Remote centres are read once per kernel; later reads hit the cache
+  // of the clusters table.
   static void updatePoints(const int32_t& key, Point& p) {
+    std::vector<int32_t> ids(FLAGS_num_clusters);
+    std::vector<Cluster> current(FLAGS_num_clusters);
+    for (int i = 0; i < FLAGS_num_clusters; ++i) {
+      ids[i] = i;
+    }
+    clusters->getMany(&ids[0], FLAGS_num_clusters, &current[0]);
+
     p.min_dist = 2;
     for (int i = 0; i < FLAGS_num_clusters; ++i) {
-      const Cluster& c = clusters->get(i);
+      const Cluster& c = current[i];
       double d_squared = pow(p.x - c.x, 2) + pow(p.y - c.y, 2);
       if (d_squared < p.min_dist) {
         p.min_dist = d_squared;
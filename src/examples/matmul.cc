@@ -74,11 +74,11 @@ struct MatrixMultiplication {
     bCols = FLAGS_edge_size / FLAGS_block_size;
     bRows = FLAGS_edge_size / FLAGS_block_size;
 
-    matrix_a = TableRegistry::sparse(bCols * bRows, new Sharding::Mod,
+    matrix_a = TableRegistry::dense(bCols * bRows, new Sharding::Mod,
         new BlockSum);
-    matrix_b = TableRegistry::sparse(bCols * bRows, new Sharding::Mod,
+    matrix_b = TableRegistry::dense(bCols * bRows, new Sharding::Mod,
         new BlockSum);
-    matrix_c = TableRegistry::sparse(bCols * bRows, new Sharding::Mod,
+    matrix_c = TableRegistry::dense(bCols * bRows, new Sharding::Mod,
         new BlockSum);
   }
 
@@ -109,19 +109,34 @@ struct MatrixMultiplication {
   }
 
   static void multiply(TableT<int, Block>* table, int my_shard) {
-    Block a, b, c;
+    Block a, c;
 
     int numShards = matrix_a->numShards();
     ShardHelper sh(my_shard, numShards);
 
     for (int k = 0; k < bRows; k++) {
+      bool used = false;
+      for (int i = 0; i < bRows; i++) {
+        used |= sh.is_local(i, k);
+      }
+      if (!used) {
+        continue;
+      }
+
+      // Request all of row k of B at once; the fetches overlap with the
+      // multiplications that use the blocks already received.
+      std::vector<Future<Block> > row;
+      for (int j = 0; j < bCols; j++) {
+        row.push_back(matrix_b->getAsync(sh.block_id(k, j)));
+      }
+
       for (int i = 0; i < bRows; i++) {
         for (int j = 0; j < bCols; j++) {
           if (!sh.is_local(i, k)) {
             continue;
           }
           a = matrix_a->get(sh.block_id(i, k));
-          b = matrix_b->get(sh.block_id(k, j));
+          const Block& b = row[j].get();
           cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
               FLAGS_block_size, FLAGS_block_size, FLAGS_block_size, 1, a.d,
               FLAGS_block_size, b.d, FLAGS_block_size, 1, c.d,
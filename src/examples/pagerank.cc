@@ -41,10 +41,6 @@ std::ostream& operator<<(std::ostream& s, const PageId& a) {
   return s << a.site << ":" << a.page;
 }
 
-size_t hash_value(const PageId& p) {
-  return SuperFastHash((const char*) &p, sizeof p);
-}
-
 struct SiteSharding: public Sharder<PageId> {
   int operator()(const PageId& p, int nshards) {
     return p.site % nshards;
@@ -63,12 +59,19 @@ void PRMapper(const uint64_t& id, Page& n) {
   float v = curr_pr->get(p, 0);
 
   float contribution = kPropagationFactor * v / n.target_site_size();
+  vector<PageId> targets;
+  targets.reserve(n.target_site_size());
   for (int i = 0; i < n.target_site_size(); ++i) {
     PageId target = {n.target_site(i), n.target_id(i)};
     if (!(target == p)) {
-      next_pr->update(target, contribution);
+      targets.push_back(target);
     }
   }
+
+  if (!targets.empty()) {
+    vector<float> contributions(targets.size(), contribution);
+    next_pr->updateMany(&targets[0], &contributions[0], targets.size());
+  }
 }
 
 struct Pagerank {
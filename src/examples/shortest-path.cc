@@ -14,7 +14,7 @@ struct ShortestPath {
   void setup(const ConfigData& conf) {
     NUM_WORKERS = conf.num_workers();
 
-    distance_map = TableRegistry::sparse(FLAGS_shards, new Sharding::Mod,
+    distance_map = TableRegistry::dense(FLAGS_shards, new Sharding::Mod,
         new Accumulators<double>::Min);
 
     // nodes = TableRegistry::record(FLAGS_source);
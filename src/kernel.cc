@@ -3,6 +3,12 @@
 #include "piccolo/kernel.h"
 #include "piccolo/table.h"
 
+DEFINE_int32(map_threads, 4,
+    "Threads that map a single large shard in parallel.");
+DEFINE_int64(map_split_entries, 1 << 20,
+    "Shards with at least this many entries are split between "
+    "--map_threads threads by map().");
+
 namespace piccolo {
 
 ShardedTable* Kernel::table(int id) {
@@ -11,6 +17,8 @@ ShardedTable* Kernel::table(int id) {
   return t;
 }
 
-KernelRegistry::Map KernelRegistry::kernels;
+void Kernel::run(ShardedTable* table, int shard) {
+  LOG(FATAL) << "This kernel has no run(table, shard) method.";
+}
 
 }
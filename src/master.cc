@@ -1,5 +1,6 @@
 #include "piccolo/master.h"
 #include "piccolo/table.h"
+#include "piccolo/table-inl.h"
 
 #include "util/common.h"
 #include "util/tuple.h"
@@ -13,11 +14,52 @@ using std::set;
 
 DEFINE_bool(work_stealing, true, "");
 DECLARE_double(sleep_time);
+DECLARE_int32(kernel_threads);
 
 namespace piccolo {
 
 static std::set<int> dead_workers;
 
+// The master of this process, if it is the master.
+static Master* current_master = NULL;
+
+void RunKernelOnShards(Table* table, int kernelId) {
+  CHECK(current_master != NULL) << "Kernels can only be run from the master.";
+  ShardedTable* t = dynamic_cast<ShardedTable*>(table);
+  CHECK(t != NULL) << "Kernels can only be run over sharded tables.";
+
+  RunDescriptor r;
+  r.table = t;
+  r.kernelId = kernelId;
+  current_master->run(r);
+}
+
+static boost::mutex control_lock;
+static TableControl pending_control;
+
+void QueueTableControl(const TableControl::Op& op) {
+  CHECK(current_master != NULL);
+  boost::mutex::scoped_lock sl(control_lock);
+  pending_control.add_op()->CopyFrom(op);
+}
+
+void SendTableControl() {
+  if (current_master == NULL) {
+    return;
+  }
+
+  TableControl req;
+  {
+    boost::mutex::scoped_lock sl(control_lock);
+    if (pending_control.op_size() == 0) {
+      return;
+    }
+    req.Swap(&pending_control);
+  }
+  VLOG(1) << "Sending table control: " << req;
+  rpc::NetworkThread::Get()->SyncBroadcast(MTYPE_TABLE_CONTROL, req);
+}
+
 struct Taskid {
   int table;
   int shard;
@@ -230,9 +272,22 @@ Master::Master(const ConfigData &conf) :
   }
 
   LOG(INFO)<< "All workers registered; starting up.";
+
+  // The master owns no shards; its writes are buffered and sent to the
+  // owners when the next kernel starts.
+  for (TableRegistry::Map::iterator i = tables_.begin(); i != tables_.end();
+      ++i) {
+    i->second->setWorkerId(-1);
+  }
+  assign_tables();
+  send_table_assignments();
+
+  CHECK(current_master == NULL);
+  current_master = this;
 }
 
 Master::~Master() {
+  current_master = NULL;
   LOG(INFO)<< "Total runtime: " << runtime_.elapsed();
 
   LOG(INFO) << "Worker execution time:";
@@ -308,6 +363,7 @@ void Master::send_table_assignments() {
       s->set_table(j->table);
       s->set_shard(j->shard);
 //      s->set_old_worker(-1);
+      tables_[j->table]->assignShard(j->shard, i);
     }
   }
 
@@ -411,8 +467,11 @@ int Master::dispatch_work(const RunDescriptor& r) {
   KernelRequest w_req;
   for (size_t i = 0; i < workers_.size(); ++i) {
     WorkerState& w = *workers_[i];
-    if (w.num_pending() > 0 && w.num_active() == 0) {
+    // Each worker runs up to --kernel_threads shards at once.
+    while (w.num_pending() > 0 &&
+        w.num_active() < (size_t) FLAGS_kernel_threads) {
       w.get_next(r, &w_req);
+      w_req.set_epoch(kernel_epoch_);
       num_dispatched++;
       network_->Send(w.id + 1, MTYPE_RUN_KERNEL, w_req);
     }
@@ -433,6 +492,7 @@ int Master::reap_one_task() {
   KernelDone done_msg;
   int w_id = 0;
 
+  uint64_t seen = network_->arrivals();
   if (network_->TryRead(rpc::ANY_SOURCE, MTYPE_KERNEL_DONE, &done_msg, &w_id)) {
 
     w_id -= 1;
@@ -454,7 +514,7 @@ int Master::reap_one_task() {
     w.ping();
     return w_id;
   } else {
-    Sleep(FLAGS_sleep_time);
+    network_->WaitForArrival(seen, FLAGS_sleep_time);
     return -1;
   }
 
@@ -479,6 +539,14 @@ void Master::run(RunDescriptor r) {
 
   kernel_epoch_++;
 
+  // Send anything written by the master since the last run; it reaches
+  // each worker before the kernel requests do.
+  SendTableControl();
+  for (TableRegistry::Map::iterator i = tables_.begin(); i != tables_.end();
+      ++i) {
+    i->second->flush();
+  }
+
   VLOG(1) << "Current run: " << shards.size() << " shards";
   assign_tasks(current_run_, shards);
 
@@ -524,48 +592,33 @@ void Master::barrier() {
         dispatched_ += dispatch_work(current_run_);
       }
     }
+  }
 
-    VLOG(3) << "All kernels finished in barrier() with finished_=" << finished_;
-    VLOG(1) << "Kernels finished, in flush/apply phase";
-
-    bool quiescent;
-    EmptyMessage empty;
-    int worker_id = 0;
-    do {
-      quiescent = true;
-
-      //1st round-trip to make sure all workers have flushed everything
-      network_->Broadcast(MTYPE_WORKER_FLUSH, empty);
-      VLOG(2) << "Sent flush broadcast to workers" << endl;
-
-      size_t flushed = 0;
-      size_t applied = 0;
-      FlushResponse done_msg;
-      while (flushed < workers_.size()) {
-        VLOG(3) << "Waiting for flush responses (" << flushed << " received)"
-                   << endl;
-        if (network_->TryRead(rpc::ANY_SOURCE, MTYPE_FLUSH_RESPONSE, &done_msg,
-            &worker_id)) {
-          flushed++;
-          if (done_msg.updatesdone() > 0) {
-            quiescent = false;
-          }
-
-          VLOG(1) << "Received flush response " << flushed << " of "
-                     << workers_.size() << " with " << done_msg.updatesdone()
-                     << " updates done.";
-        } else {
-          Sleep(FLAGS_sleep_time);
-        }
-      }
-    } while (1);
-
-    //2nd round-trip to make sure all workers have applied all updates
-    network_->Broadcast(MTYPE_WORKER_APPLY, empty);
-    VLOG(2) << "Sent apply broadcast to workers" << endl;
-
-    mstats.set_total_time(mstats.total_time() + Now() - current_run_start_);
+  VLOG(3) << "All kernels finished in barrier() with finished_=" << finished_;
+  VLOG(1) << "Kernels finished, in flush/apply phase";
+
+  // Termination detection.  Each wave flushes every worker's buffers and
+  // sums, up a tree of workers, the put batches sent and applied by every
+  // process since startup.  Once the kernels are done, batches are only
+  // sent by flushes (applying one never sends another), so the updates
+  // have all been applied when two consecutive waves see the same totals
+  // with every batch sent also applied.  That normally takes two waves of
+  // O(log workers) depth, with one reply to the master each.
+  EmptyMessage empty;
+  int64_t last_sent = -1;
+  while (true) {
+    FlushResponse done;
+    network_->Call(1, MTYPE_WORKER_FLUSH, empty, &done);
+    int64_t sent = done.sent() + RemoteTable::batchesSent();
+    VLOG(1) << "Flush wave: " << done.updatesdone() << " entries flushed, "
+               << sent << " batches sent, " << done.applied() << " applied.";
+    if (sent == done.applied() && sent == last_sent) {
+      break;
+    }
+    last_sent = sent;
   }
+
+  mstats.set_total_time(mstats.total_time() + Now() - current_run_start_);
 }
 
 } // namespace piccolo
@@ -1,13 +1,30 @@
 #include "piccolo/table.h"
 #include "piccolo/table-inl.h"
 #include "util/tuple.h"
+#include "util/static-initializers.h"
+
+#include <deque>
+#include <map>
+
+DEFINE_int64(sparse_table_incremental_resize, 1 << 22,
+    "SparseTables with at least this many buckets grow incrementally "
+    "rather than rehashing every entry at once; 0 disables.");
+DEFINE_bool(delta_table_data, false,
+    "Send bulk table data sorted by key with delta and varint coded keys "
+    "and integer values.");
+DEFINE_double(remote_flush_interval, 0.5,
+    "Seconds a worker may buffer updates for a remote shard before "
+    "sending them to its owner.");
+DEFINE_int64(remote_cache_entries, 1 << 16,
+    "Values read from each remote shard that a worker caches until the "
+    "next kernel; 0 disables the cache.");
 
 namespace piccolo {
 
 TableRegistry::Map TableRegistry::tables;
 
 ProtoTableCoder::ProtoTableCoder(TableData* t) :
-    t_(t), pos_(0) {
+    t_(t), pos_(0), bulk_pos_(0) {
 }
 
 void ProtoTableCoder::write(StringPiece key, StringPiece value) {
@@ -26,36 +43,213 @@ bool ProtoTableCoder::read(string* key, string* value) {
   return false;
 }
 
+bool ProtoTableCoder::writeBulk(const StringPiece& block) {
+  t_->mutable_table_data()->append(block.data, block.len);
+  return true;
+}
+
+bool ProtoTableCoder::readBulk(StringPiece* block) {
+  const string& data = t_->table_data();
+  if (bulk_pos_ >= (int64_t) data.size()) {
+    return false;
+  }
+
+  BulkHeader h;
+  CHECK_GE(data.size() - bulk_pos_, sizeof(h));
+  memcpy(&h, data.data() + bulk_pos_, sizeof(h));
+  CHECK_LE(bulk_pos_ + h.bytes(), (int64_t) data.size());
+
+  *block = StringPiece(data.data() + bulk_pos_, h.bytes());
+  bulk_pos_ += h.bytes();
+  return true;
+}
+
+RemoteGets* RemoteGets::Get() {
+  static RemoteGets* gets = new RemoteGets;
+  return gets;
+}
+
+RemoteGets::RemoteGets() :
+    next_(0) {
+}
+
+uint32_t RemoteGets::send(int worker, HashGet* req) {
+  uint32_t index;
+  {
+    boost::mutex::scoped_lock sl(lock_);
+    index = next_++;
+  }
+  req->set_index(index);
+  SendTableControl();
+  rpc::NetworkThread::Get()->Send(worker + 1, MTYPE_GET, *req);
+  return index;
+}
+
+bool RemoteGets::tryReceive(int worker, uint32_t index, TableData* resp) {
+  boost::mutex::scoped_lock sl(lock_);
+  std::map<uint32_t, TableData*>::iterator i = arrived_.find(index);
+  if (i != arrived_.end()) {
+    resp->Swap(i->second);
+    delete i->second;
+    arrived_.erase(i);
+    return true;
+  }
+
+  TableData r;
+  while (rpc::NetworkThread::Get()->TryReadReply(worker + 1, MTYPE_GET, &r)) {
+    if (r.index() == index) {
+      resp->Swap(&r);
+      return true;
+    }
+    arrived_[r.index()] = new TableData(r);
+  }
+  return false;
+}
+
+void RemoteGets::receive(int worker, uint32_t index, TableData* resp) {
+  rpc::NetworkThread* net = rpc::NetworkThread::Get();
+  while (true) {
+    uint64_t seen = net->arrivals();
+    if (tryReceive(worker, index, resp)) {
+      return;
+    }
+    net->WaitForArrival(seen, FLAGS_sleep_time);
+  }
+}
+
+static const double kMinPageBytes = 64 << 10;
+static const double kMaxPageBytes = 16 << 20;
+
+// Replies that arrived for other iterators, by (worker, replyKey).  An
+// entry is erased with its last reply.
+typedef std::map<std::pair<int, int>, std::deque<IteratorResponse*> >
+    ReplyMap;
+static boost::mutex iterator_replies_lock;
+static ReplyMap iterator_replies;
+static volatile uint32_t iterator_tags = 0;
+
+// Pages are matched by iterator id; the opening reply, sent before the
+// iterator has an id, by the tag of its request.
+static int replyKey(const IteratorResponse& r) {
+  return r.has_tag() ? -1 - int(r.tag()) : int(r.id());
+}
+
 RemoteIterator::RemoteIterator(ShardedTable *table, int shard) :
-    owner_(table), shard_(shard), done_(false) {
+    owner_(table), shard_(shard), inflight_(0), page_bytes_(kMinPageBytes),
+    row_bytes_(0) {
+  worker_ = table->workerForShard(shard);
   request_.set_table(table->id());
   request_.set_shard(shard_);
   request_.set_row_count(kReadAhead);
-  int target_worker = table->workerForShard(shard);
-  rpc::NetworkThread::Get()->Call(target_worker + 1, MTYPE_ITERATOR, request_,
-      &response_);
+  request_.set_tag(__sync_fetch_and_add(&iterator_tags, 1) & 0x7fffffff);
+  SendTableControl();
+  rpc::NetworkThread::Get()->Send(worker_ + 1, MTYPE_ITERATOR, request_);
+  waitFor(-1 - int(request_.tag()), &response_);
+  request_.clear_tag();
   request_.set_id(response_.id());
   pos_ = 0;
+
+  if (!response_.done()) {
+    prefetch();
+  }
+  while (pos_ == response_.row_count() && !response_.done()) {
+    nextPage();
+  }
+}
+
+// Drain the pages still in flight, so their replies are not left queued.
+RemoteIterator::~RemoteIterator() {
+  IteratorResponse resp;
+  for (; inflight_ > 0; --inflight_) {
+    waitFor(request_.id(), &resp);
+  }
+}
+
+void RemoteIterator::waitFor(int key, IteratorResponse* resp) {
+  rpc::NetworkThread* net = rpc::NetworkThread::Get();
+  while (true) {
+    uint64_t seen = net->arrivals();
+    if (receive(key, resp)) {
+      return;
+    }
+    net->WaitForArrival(seen, FLAGS_sleep_time);
+  }
+}
+
+int RemoteIterator::pageRows() {
+  if (row_bytes_ == 0) {
+    return kReadAhead;
+  }
+  return std::max(1, int(page_bytes_ / row_bytes_));
+}
+
+void RemoteIterator::prefetch() {
+  while (inflight_ < kPrefetchPages) {
+    request_.set_row_count(pageRows());
+    SendTableControl();
+    rpc::NetworkThread::Get()->Send(worker_ + 1, MTYPE_ITERATOR, request_);
+    ++inflight_;
+  }
+}
+
+bool RemoteIterator::receive(int key, IteratorResponse* resp) {
+  boost::mutex::scoped_lock sl(iterator_replies_lock);
+  ReplyMap::iterator mine = iterator_replies.find(std::make_pair(worker_, key));
+  if (mine != iterator_replies.end()) {
+    resp->Swap(mine->second.front());
+    delete mine->second.front();
+    mine->second.pop_front();
+    if (mine->second.empty()) {
+      iterator_replies.erase(mine);
+    }
+    return true;
+  }
+
+  IteratorResponse r;
+  while (rpc::NetworkThread::Get()->TryReadReply(worker_ + 1, MTYPE_ITERATOR,
+      &r)) {
+    if (replyKey(r) == key) {
+      resp->Swap(&r);
+      return true;
+    }
+    iterator_replies[std::make_pair(worker_, replyKey(r))].push_back(
+        new IteratorResponse(r));
+  }
+  return false;
+}
+
+void RemoteIterator::nextPage() {
+  CHECK_GT(inflight_, 0);
+  if (!receive(request_.id(), &response_)) {
+    // The pages in flight did not cover the round trip.
+    page_bytes_ = std::min(2 * page_bytes_, kMaxPageBytes);
+    waitFor(request_.id(), &response_);
+  }
+  --inflight_;
+  pos_ = 0;
+
+  if (response_.row_count() > 0) {
+    int64_t bytes = 0;
+    for (uint32_t i = 0; i < response_.row_count(); ++i) {
+      bytes += response_.key(i).size() + response_.value(i).size();
+    }
+    row_bytes_ = double(bytes) / response_.row_count();
+  }
+
+  if (!response_.done()) {
+    prefetch();
+  }
 }
 
 void RemoteIterator::Next() {
-  int target_worker = dynamic_cast<ShardedTable*>(owner_)->workerForShard(
-      shard_);
-  if (pos_ == response_.row_count() - 1) {
-    CHECK(!response_.done());
-    rpc::NetworkThread::Get()->Call(target_worker + 1, MTYPE_ITERATOR, request_,
-        &response_);
-    if (response_.row_count() < 1 && !response_.done())
-      LOG(ERROR)<< "Call to server requesting " << request_.row_count()
-      << " rows returned " << response_.row_count() << " rows.";
-    pos_ = 0;
-  } else {
-    ++pos_;
+  ++pos_;
+  while (pos_ >= response_.row_count() && !response_.done()) {
+    nextPage();
   }
 }
 
 bool RemoteIterator::done() {
-  return response_.done() && pos_ == response_.row_count();
+  return response_.done() && pos_ >= response_.row_count();
 }
 
 void RemoteIterator::valueStr(string* out) {
@@ -66,4 +260,500 @@ void RemoteIterator::keyStr(string* out) {
   *out = response_.key(pos_);
 }
 
+static volatile int64_t batches_sent = 0;
+
+int64_t RemoteTable::batchesSent() {
+  return batches_sent;
+}
+
+void RemoteTable::countSent() {
+  __sync_fetch_and_add(&batches_sent, 1);
+}
+
+// The map flag is set and cleared under the lock, so a writer that sees it
+// set is woken by endMap().
+void ShardMutex::lockForWrite() {
+  mutex_.lock();
+  while (mapped_) {
+    unmapped_.wait(mutex_);
+  }
+}
+
+void ShardMutex::beginMap() {
+  boost::mutex::scoped_lock sl(mutex_);
+  mapped_ = true;
+}
+
+void ShardMutex::endMap() {
+  {
+    boost::mutex::scoped_lock sl(mutex_);
+    mapped_ = false;
+  }
+  unmapped_.notify_all();
+}
+
+bool ShardMutex::mapped() {
+  boost::mutex::scoped_lock sl(mutex_);
+  return mapped_;
+}
+
+static __thread UpdateBuffers* current_buffers = NULL;
+
+UpdateBuffers::~UpdateBuffers() {
+  CHECK(buffers_.empty()) << "UpdateBuffers deleted without flush().";
+}
+
+UpdateBuffers* UpdateBuffers::current() {
+  return current_buffers;
+}
+
+void UpdateBuffers::setCurrent(UpdateBuffers* b) {
+  current_buffers = b;
+}
+
+Table* UpdateBuffers::find(ShardedTable* t) {
+  std::map<ShardedTable*, Buffer>::iterator i = buffers_.find(t);
+  return i == buffers_.end() ? NULL : i->second.table;
+}
+
+void UpdateBuffers::add(ShardedTable* t, Table* buffer, ApplyFunction apply) {
+  Buffer b = { buffer, apply };
+  buffers_[t] = b;
+}
+
+void UpdateBuffers::flush() {
+  CHECK(current() != this);
+  for (std::map<ShardedTable*, Buffer>::iterator i = buffers_.begin();
+       i != buffers_.end(); ++i) {
+    i->second.apply(i->first, i->second.table);
+    delete i->second.table;
+  }
+  buffers_.clear();
+}
+
+static void SparseTableTestRemove() {
+  Accumulators<int>::Sum sum;
+  SparseTable<int, int> t(1, &sum);
+  std::map<int, int> ref;
+
+  for (int i = 0; i < 100000; ++i) {
+    int k = random() % 5000;
+    switch (random() % 3) {
+    case 0:
+      t.update(k, i);
+      ref[k] += i;
+      break;
+    case 1:
+      t.remove(k);
+      ref.erase(k);
+      break;
+    case 2:
+      CHECK_EQ(t.contains(k), ref.find(k) != ref.end());
+      break;
+    }
+  }
+
+  CHECK_EQ(t.size(), (int64_t) ref.size());
+  for (std::map<int, int>::iterator i = ref.begin(); i != ref.end(); ++i) {
+    CHECK_EQ(t.get(i->first), i->second);
+  }
+}
+REGISTER_TEST(SparseTableRemove, SparseTableTestRemove());
+
+// 0.0 and -0.0 compare equal, so they must find the same entry.
+static void SparseTableTestSignedZero() {
+  Accumulators<int>::Sum sum;
+  SparseTable<double, int> d(1, &sum);
+  d.update(0.0, 1);
+  d.update(-0.0, 2);
+  CHECK_EQ(d.size(), 1);
+  CHECK_EQ(d.get(-0.0), 3);
+
+  SparseTable<float, int> f(1, &sum);
+  f.update(-0.0f, 1);
+  CHECK(f.contains(0.0f));
+}
+REGISTER_TEST(SparseTableSignedZero, SparseTableTestSignedZero());
+
+template<class TableType>
+static void CheckIteratorsCover(TableType* t, int count) {
+  std::vector<TableIteratorT<int, int>*> iters;
+  t->typedIterators(count, &iters);
+  CHECK_LE((int) iters.size(), count);
+
+  std::map<int, int> seen;
+  for (size_t i = 0; i < iters.size(); ++i) {
+    for (; !iters[i]->done(); iters[i]->Next()) {
+      CHECK_EQ(iters[i]->value(), iters[i]->key() * 2);
+      ++seen[iters[i]->key()];
+    }
+    delete iters[i];
+  }
+
+  CHECK_EQ((int64_t) seen.size(), t->size());
+  for (std::map<int, int>::iterator i = seen.begin(); i != seen.end(); ++i) {
+    CHECK_EQ(i->second, 1);
+  }
+}
+
+static void TableTestTypedIterators() {
+  Accumulators<int>::Sum sum;
+  SparseTable<int, int> sparse(1, &sum);
+  DenseTable<int, int> dense(1, &sum);
+  for (int i = 0; i < 10000; ++i) {
+    int k = random() % 50000;
+    sparse.put(k, k * 2);
+    dense.put(k, k * 2);
+  }
+
+  for (int count = 1; count <= 7; ++count) {
+    CheckIteratorsCover(&sparse, count);
+    CheckIteratorsCover(&dense, count);
+  }
+}
+REGISTER_TEST(TableTypedIterators, TableTestTypedIterators());
+
+// Lookups interleaved with the inserts and removes that drive an
+// incremental resize must see every entry, whichever array holds it.
+static void SparseTableTestIncrementalResize() {
+  int64_t saved = FLAGS_sparse_table_incremental_resize;
+  FLAGS_sparse_table_incremental_resize = 64;
+
+  Accumulators<int>::Sum sum;
+  SparseTable<int, int> t(1, &sum);
+  std::map<int, int> ref;
+  bool resized = false;
+
+  for (int i = 0; i < 50000; ++i) {
+    int k = random() % 100000;
+    if (random() % 4 == 0) {
+      t.remove(k);
+      ref.erase(k);
+    } else {
+      t.update(k, i);
+      ref[k] += i;
+    }
+    resized |= t.resizing();
+
+    int probe = random() % 100000;
+    CHECK_EQ(t.contains(probe), ref.find(probe) != ref.end());
+    if (ref.find(probe) != ref.end()) {
+      CHECK_EQ(t.get(probe), ref[probe]);
+    }
+
+    int keys[4] = { k, probe, k + 1, probe + 1 };
+    bool found[4];
+    t.containsMany(keys, 4, found);
+    for (int j = 0; j < 4; ++j) {
+      CHECK_EQ(found[j], ref.find(keys[j]) != ref.end());
+    }
+  }
+
+  CHECK(resized);
+  CHECK_EQ(t.size(), (int64_t) ref.size());
+  for (std::map<int, int>::iterator i = ref.begin(); i != ref.end(); ++i) {
+    CHECK_EQ(t.get(i->first), i->second);
+  }
+
+  FLAGS_sparse_table_incremental_resize = saved;
+}
+REGISTER_TEST(SparseTableIncrementalResize, SparseTableTestIncrementalResize());
+
+// Sends every key to the last few buckets of a 64 bucket table, so
+// clusters are long and wrap around the end of the array.
+struct CollidingHash {
+  uint64_t operator()(int k) const {
+    return (uint64_t(k % 7) << 57) | (60 + k % 4);
+  }
+};
+
+// Removing from the middle of a cluster shifts the rest of it back; every
+// remaining key must still be found from its home bucket.
+static void SparseTableTestBackwardShift() {
+  Accumulators<int>::Sum sum;
+  for (int round = 0; round < 100; ++round) {
+    SparseTable<int, int, CollidingHash> t(40, &sum);
+    CHECK_EQ(t.capacity(), 64);
+
+    std::vector<int> keys;
+    for (int k = 0; k < 48; ++k) {
+      t.put(k, k * 2);
+      keys.push_back(k);
+    }
+    std::random_shuffle(keys.begin(), keys.end());
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+      t.remove(keys[i]);
+      CHECK(!t.contains(keys[i]));
+      for (size_t j = i + 1; j < keys.size(); ++j) {
+        CHECK_EQ(t.get(keys[j]), keys[j] * 2);
+      }
+      CHECK_EQ(t.size(), (int64_t) (keys.size() - i - 1));
+    }
+    CHECK_EQ(t.capacity(), 64);
+  }
+}
+REGISTER_TEST(SparseTableBackwardShift, SparseTableTestBackwardShift());
+
+struct SparseTableTest {
+  template<class K, class V>
+  static uint32_t epoch(SparseTable<K, V>* t) {
+    return t->cur_.epoch;
+  }
+
+  // Only valid on an empty table: every chunk becomes stale, as after a
+  // clear().
+  template<class K, class V>
+  static void setEpoch(SparseTable<K, V>* t, uint32_t epoch) {
+    CHECK(t->empty());
+    t->cur_.epoch = epoch;
+  }
+};
+
+// Clears that wrap the epoch around must still leave the table empty, and
+// entries written just before and after the wrap must read back.
+static void SparseTableTestClearWrap() {
+  Accumulators<int>::Sum sum;
+  SparseTable<int, int> t(4096, &sum);
+  int64_t capacity = t.capacity();
+  SparseTableTest::setEpoch(&t, 0xfffffff0u);
+
+  for (int round = 0; round < 40; ++round) {
+    std::map<int, int> ref;
+    for (int i = 0; i < 1000; ++i) {
+      int k = random() % 5000;
+      t.update(k, i);
+      ref[k] += i;
+    }
+
+    CHECK_EQ(t.size(), (int64_t) ref.size());
+    for (int k = 0; k < 5000; ++k) {
+      CHECK_EQ(t.contains(k), ref.find(k) != ref.end());
+    }
+    for (std::map<int, int>::iterator i = ref.begin(); i != ref.end(); ++i) {
+      CHECK_EQ(t.get(i->first), i->second);
+    }
+
+    t.clear();
+    CHECK(t.empty());
+    TableIteratorT<int, int>* it = t.typedIterator();
+    CHECK(it->done());
+    delete it;
+    for (std::map<int, int>::iterator i = ref.begin(); i != ref.end(); ++i) {
+      CHECK(!t.contains(i->first));
+    }
+  }
+
+  // The epoch wrapped, and the bucket array was reused throughout.
+  CHECK_LT(SparseTableTest::epoch(&t), 0xfffffff0u);
+  CHECK_EQ(t.capacity(), capacity);
+}
+REGISTER_TEST(SparseTableClearWrap, SparseTableTestClearWrap());
+
+// One shard of a Mod-sharded table: keys share a residue modulo the shard
+// count, and keys of other residues or below zero are never present.
+static void DenseTableTestStride() {
+  static const int kShards = 5;
+  Accumulators<int>::Sum sum;
+  for (int offset = 0; offset < kShards; ++offset) {
+    DenseTable<int, int> t(kShards, &sum);
+    std::map<int, int> ref;
+    for (int i = 0; i < 20000; ++i) {
+      int k = (random() % 10000) * kShards + offset;
+      if (random() % 5 == 0) {
+        t.remove(k);
+        ref.erase(k);
+      } else {
+        t.update(k, i);
+        ref[k] += i;
+      }
+    }
+
+    CHECK_EQ(t.size(), (int64_t) ref.size());
+    for (int k = -kShards; k < 10000 * kShards; ++k) {
+      CHECK_EQ(t.contains(k), ref.find(k) != ref.end());
+    }
+
+    // Iteration recovers each key from its slot, in key order.
+    std::map<int, int>::iterator r = ref.begin();
+    TableIteratorT<int, int>* it = t.typedIterator();
+    for (; !it->done(); it->Next(), ++r) {
+      CHECK(r != ref.end());
+      CHECK_EQ(it->key(), r->first);
+      CHECK_EQ(it->value(), r->second);
+    }
+    CHECK(r == ref.end());
+    delete it;
+
+    for (int count = 1; count <= 7; ++count) {
+      std::vector<TableIteratorT<int, int>*> iters;
+      t.typedIterators(count, &iters);
+      int64_t seen = 0;
+      for (size_t i = 0; i < iters.size(); ++i) {
+        for (; !iters[i]->done(); iters[i]->Next()) {
+          CHECK_EQ(iters[i]->key() % kShards, offset);
+          ++seen;
+        }
+        delete iters[i];
+      }
+      CHECK_EQ(seen, t.size());
+    }
+  }
+}
+REGISTER_TEST(DenseTableStride, DenseTableTestStride());
+
+static const int kConcurrentTestThreads = 8;
+static const int kConcurrentTestKeys = 10000;
+
+// Each thread adds 1 to every shared key, and owns a range of private keys
+// that it puts, reads back and removes.
+static void ConcurrentTableTestThread(ConcurrentSparseTable<int, int>* t,
+    int id) {
+  int base = kConcurrentTestKeys * (id + 1);
+  for (int k = 0; k < kConcurrentTestKeys; ++k) {
+    t->update(k, 1);
+    t->put(base + k, k);
+    CHECK_EQ(t->get(base + k), k);
+    if (k % 2 == 0) {
+      t->remove(base + k);
+      CHECK(!t->contains(base + k));
+    }
+  }
+}
+
+// Sums the shared keys while the writers run, copying one stripe at a time.
+static void ConcurrentTableTestReader(ConcurrentSparseTable<int, int>* t) {
+  for (int pass = 0; pass < 20; ++pass) {
+    TableIteratorT<int, int>* it = t->typedIterator();
+    for (; !it->done(); it->Next()) {
+      if (it->key() < kConcurrentTestKeys) {
+        CHECK_GE(it->value(), 1);
+        CHECK_LE(it->value(), kConcurrentTestThreads);
+      }
+    }
+    delete it;
+  }
+}
+
+static void ConcurrentTableTestThreads() {
+  Accumulators<int>::Sum sum;
+  ConcurrentSparseTable<int, int> t(1, &sum);
+
+  boost::thread_group threads;
+  for (int i = 0; i < kConcurrentTestThreads; ++i) {
+    threads.create_thread(boost::bind(&ConcurrentTableTestThread, &t, i));
+  }
+  threads.create_thread(boost::bind(&ConcurrentTableTestReader, &t));
+  threads.join_all();
+
+  CHECK_EQ(t.size(),
+      (int64_t) kConcurrentTestKeys * (1 + kConcurrentTestThreads / 2));
+  for (int k = 0; k < kConcurrentTestKeys; ++k) {
+    CHECK_EQ(t.get(k), kConcurrentTestThreads);
+  }
+  for (int i = 0; i < kConcurrentTestThreads; ++i) {
+    int base = kConcurrentTestKeys * (i + 1);
+    for (int k = 0; k < kConcurrentTestKeys; ++k) {
+      CHECK_EQ(t.contains(base + k), k % 2 == 1);
+    }
+  }
+}
+REGISTER_TEST(ConcurrentTableThreads, ConcurrentTableTestThreads());
+
+// A struct key of 32-bit fields, like PageId in the PageRank example.
+struct BulkTestKey {
+  int32_t site;
+  int32_t page;
+};
+
+static bool operator==(const BulkTestKey& a, const BulkTestKey& b) {
+  return a.site == b.site && a.page == b.page;
+}
+
+// Write a table holding 'keys' and 'values' (keys distinct), check it went
+// out as a single bulk block of 'format', and read it back into a new table.
+template<class K, class V>
+static void CheckBulkRoundTrip(const std::vector<K>& keys,
+    const std::vector<V>& values, BulkFormat format) {
+  typename Accumulators<V>::Replace replace;
+  SparseTable<K, V> src(1, &replace);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    src.put(keys[i], values[i]);
+  }
+  CHECK_EQ(src.size(), (int64_t) keys.size());
+
+  TableData data;
+  ProtoTableCoder out(&data);
+  src.write(&out);
+  CHECK_EQ(data.kv_data_size(), 0);
+
+  BulkHeader h;
+  CHECK_GE(data.table_data().size(), sizeof(h));
+  memcpy(&h, data.table_data().data(), sizeof(h));
+  CHECK_EQ(h.format, (uint32_t) format);
+  CHECK_EQ(h.count, keys.size());
+  CHECK_EQ(h.bytes(), (int64_t) data.table_data().size());
+
+  SparseTable<K, V> dst(1, &replace);
+  ProtoTableCoder in(&data);
+  CHECK_EQ(dst.read(&in), (int64_t) keys.size());
+  CHECK_EQ(dst.size(), (int64_t) keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    CHECK_EQ(dst.get(keys[i]), values[i]);
+  }
+}
+
+// Keys and values for the bulk tests: negative and positive integers, the
+// extremes of int64_t, and struct keys with negative fields.
+static void BulkTestData(std::vector<int>* ints, std::vector<int64_t>* longs,
+    std::vector<BulkTestKey>* structs, std::vector<int>* values) {
+  for (int i = 0; i < 5000; ++i) {
+    ints->push_back((i % 2 ? -1 : 1) * (i * 37 + random() % 37));
+    longs->push_back(int64_t(i - 2500) << 40);
+    BulkTestKey k = { i % 50 - 25, -(i / 50) };
+    structs->push_back(k);
+    values->push_back(int(random() % 2000) - 1000);
+  }
+  longs->front() = std::numeric_limits<int64_t>::min();
+  longs->back() = std::numeric_limits<int64_t>::max();
+}
+
+static void TableTestBulkPacked() {
+  bool saved = FLAGS_delta_table_data;
+  FLAGS_delta_table_data = false;
+
+  std::vector<int> ints, values;
+  std::vector<int64_t> longs;
+  std::vector<BulkTestKey> structs;
+  BulkTestData(&ints, &longs, &structs, &values);
+  std::vector<double> doubles(values.begin(), values.end());
+
+  CheckBulkRoundTrip(ints, values, BULK_PACKED);
+  CheckBulkRoundTrip(longs, doubles, BULK_PACKED);
+  CheckBulkRoundTrip(structs, values, BULK_PACKED);
+
+  FLAGS_delta_table_data = saved;
+}
+REGISTER_TEST(TableBulkPacked, TableTestBulkPacked());
+
+// Delta coding sorts the keys, so deltas cross zero and the int64_t
+// extremes span the whole range; struct keys are coded field by field.
+static void TableTestBulkDelta() {
+  bool saved = FLAGS_delta_table_data;
+  FLAGS_delta_table_data = true;
+
+  std::vector<int> ints, values;
+  std::vector<int64_t> longs;
+  std::vector<BulkTestKey> structs;
+  BulkTestData(&ints, &longs, &structs, &values);
+  std::vector<double> doubles(values.begin(), values.end());
+
+  CheckBulkRoundTrip(ints, values, BULK_DELTA);
+  CheckBulkRoundTrip(longs, doubles, BULK_DELTA);
+  CheckBulkRoundTrip(structs, values, BULK_DELTA);
+
+  FLAGS_delta_table_data = saved;
+}
+REGISTER_TEST(TableBulkDelta, TableTestBulkDelta());
+
 }
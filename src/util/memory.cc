@@ -0,0 +1,112 @@
+#include "util/memory.h"
+#include "util/common.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+DEFINE_int64(hugepage_threshold, 32 << 20,
+    "Table arrays of at least this many bytes are mmap'd and backed by huge "
+    "pages where possible; 0 disables.");
+DEFINE_bool(hugetlb, false,
+    "Try explicit huge pages (MAP_HUGETLB) before transparent huge pages.");
+
+namespace piccolo {
+
+static const size_t kHugePageSize = 2 << 20;
+
+static size_t RoundToHugePage(size_t bytes) {
+  return (bytes + kHugePageSize - 1) & ~(kHugePageSize - 1);
+}
+
+const char* MemoryBackingName(MemoryBacking b) {
+  switch (b) {
+  case MEM_HEAP:
+    return "heap";
+  case MEM_MMAP:
+    return "mmap";
+  case MEM_TRANSPARENT_HUGE:
+    return "transparent-hugepages";
+  case MEM_HUGETLB:
+    return "hugetlb";
+  }
+  return "unknown";
+}
+
+// Map 'len' bytes (a multiple of the huge page size) aligned to a huge page
+// boundary, so the kernel can back the whole range with huge pages.
+static void* MapAligned(size_t len) {
+  size_t padded = len + kHugePageSize;
+  char* p = (char*) mmap(NULL, padded, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+
+  char* aligned = (char*) (((uintptr_t) p + kHugePageSize - 1)
+      & ~(kHugePageSize - 1));
+  if (aligned > p) {
+    munmap(p, aligned - p);
+  }
+  size_t tail = (p + padded) - (aligned + len);
+  if (tail > 0) {
+    munmap(aligned + len, tail);
+  }
+  return aligned;
+}
+
+void* AllocateLarge(size_t bytes, MemoryBacking* backing) {
+  if (FLAGS_hugepage_threshold > 0 && bytes >= (size_t) FLAGS_hugepage_threshold) {
+    size_t len = RoundToHugePage(bytes);
+
+#ifdef MAP_HUGETLB
+    if (FLAGS_hugetlb) {
+      void* p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED) {
+        *backing = MEM_HUGETLB;
+        VLOG(1) << "Allocated " << len << " bytes of hugetlb pages.";
+        return p;
+      }
+      LOG_FIRST_N(WARNING, 1) << "Explicit huge pages unavailable ("
+          << strerror(errno) << "); falling back to transparent huge pages.";
+    }
+#endif
+
+    void* p = MapAligned(len);
+    if (p != NULL) {
+      *backing = MEM_MMAP;
+#ifdef MADV_HUGEPAGE
+      if (madvise(p, len, MADV_HUGEPAGE) == 0) {
+        *backing = MEM_TRANSPARENT_HUGE;
+      } else {
+        LOG_FIRST_N(WARNING, 1) << "Transparent huge pages unavailable ("
+            << strerror(errno) << "); using normal pages.";
+      }
+#endif
+      VLOG(1) << "Allocated " << len << " bytes backed by "
+              << MemoryBackingName(*backing);
+      return p;
+    }
+
+    LOG_FIRST_N(WARNING, 1) << "mmap of " << len << " bytes failed ("
+        << strerror(errno) << "); falling back to the heap.";
+  }
+
+  *backing = MEM_HEAP;
+  void* p = calloc(bytes, 1);
+  CHECK(p != NULL || bytes == 0)<< "Failed to allocate " << bytes << " bytes.";
+  return p;
+}
+
+void FreeLarge(void* p, size_t bytes, MemoryBacking backing) {
+  if (backing == MEM_HEAP) {
+    free(p);
+  } else {
+    munmap(p, RoundToHugePage(bytes));
+  }
+}
+
+}
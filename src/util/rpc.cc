@@ -68,7 +68,13 @@ RPCRequest::RPCRequest(int tgt, int method, const Message& ureq, Header h) {
   ureq.AppendToString(&payload);
 }
 
+// Polls of an idle network thread that immediately follow traffic, before
+// it falls back to checking every --sleep_time seconds.  Replies usually
+// follow requests closely, so this keeps round trips short.
+static const int kBusyPolls = 2000;
+
 NetworkThread::NetworkThread() {
+  arrivals_ = 0;
   if (!getenv("OMPI_COMM_WORLD_RANK")) {
     world_ = NULL;
     id_ = -1;
@@ -146,7 +152,43 @@ void NetworkThread::InvokeCallback(CallbackInfo *ci, RPCInfo rpc) {
   Send(new RPCRequest(rpc.source, rpc.tag, *ci->resp, reply_header));
 }
 
+void NetworkThread::NotifyArrival(int type) {
+  boost::mutex::scoped_lock sl(wait_lock_);
+  ++arrivals_;
+  arrived_[type].notify_all();
+  any_arrived_.notify_all();
+}
+
+void NetworkThread::WaitForArrival(uint64_t seen, double timeout) {
+  boost::mutex::scoped_lock sl(wait_lock_);
+  if (arrivals_ == seen) {
+    any_arrived_.timed_wait(sl,
+        boost::posix_time::microseconds(int64_t(timeout * 1e6)));
+  }
+}
+
+// Wait for a send to be queued, for at most --sleep_time seconds, before
+// probing MPI again.  Only local sends can wake the thread: MPI can only be
+// probed, so a message arriving while it waits is still picked up as much
+// as --sleep_time later.
+//
+// The queue is checked under send_lock while wait_lock_ is held; Send()
+// takes the two in turn, never together, so it cannot queue a request
+// between the check and the wait without its notify being seen.
+void NetworkThread::WaitForWork() {
+  boost::mutex::scoped_lock sl(wait_lock_);
+  {
+    boost::recursive_mutex::scoped_lock ql(send_lock);
+    if (!pending_sends_.empty()) {
+      return;
+    }
+  }
+  send_queued_.timed_wait(sl,
+      boost::posix_time::microseconds(int64_t(FLAGS_sleep_time * 1e6)));
+}
+
 void NetworkThread::Run() {
+  int idle = 0;
   while (running) {
     MPI::Status st;
 
@@ -167,9 +209,13 @@ void NetworkThread::Run() {
       CHECK_LT(source, kMaxHosts);
 
       VLOG(3) << "Received packet - source: " << source << " tag: " << tag;
+      idle = 0;
       if (h->is_reply) {
-        boost::recursive_mutex::scoped_lock sl(q_lock[tag]);
-        replies[tag][source].push_back(data);
+        {
+          boost::recursive_mutex::scoped_lock sl(q_lock[tag]);
+          replies[tag][source].push_back(data);
+        }
+        NotifyArrival(tag);
       } else {
         if (callbacks_[tag] != NULL) {
           CallbackInfo *ci = callbacks_[tag];
@@ -189,19 +235,25 @@ void NetworkThread::Run() {
           boost::recursive_mutex::scoped_lock sl(q_lock[tag]);
           requests[tag][source].push_back(data);
         }
+        NotifyArrival(tag);
       }
+    } else if (++idle < kBusyPolls) {
+      boost::this_thread::yield();
     } else {
-      Sleep(FLAGS_sleep_time);
+      WaitForWork();
     }
 
-    while (!pending_sends_.empty()) {
+    {
       boost::recursive_mutex::scoped_lock sl(send_lock);
-      RPCRequest* s = pending_sends_.back();
-      pending_sends_.pop_back();
-      s->start_time = Now();
-      s->mpi_req = world_->Issend(
-          s->payload.data(), s->payload.size(), MPI::BYTE, s->target, s->rpc_type);
-      active_sends_.insert(s);
+      while (!pending_sends_.empty()) {
+        idle = 0;
+        RPCRequest* s = pending_sends_.front();
+        pending_sends_.pop_front();
+        s->start_time = Now();
+        s->mpi_req = world_->Issend(
+            s->payload.data(), s->payload.size(), MPI::BYTE, s->target, s->rpc_type);
+        active_sends_.insert(s);
+      }
     }
 
     CollectActive();
@@ -255,8 +307,9 @@ bool NetworkThread::check_reply_queue(int src, int type, Message* data) {
   // Blocking read for the given source and message type.
 void NetworkThread::Read(int desired_src, int type, Message* data, int *source) {
   Timer t;
+  boost::mutex::scoped_lock sl(wait_lock_);
   while (!TryRead(desired_src, type, data, source)) {
-    Sleep(FLAGS_sleep_time);
+    arrived_[type].wait(sl);
   }
   stats["network_time"] += t.elapsed();
 }
@@ -280,19 +333,32 @@ bool NetworkThread::TryRead(int src, int type, Message* data, int *source) {
 
 void NetworkThread::Call(int dst, int method, const Message &msg, Message *reply) {
   Send(dst, method, msg);
-  Timer t;
-  while (!check_reply_queue(dst, method, reply)) {
-    Sleep(FLAGS_sleep_time);
+  ReadReply(dst, method, reply);
+}
+
+void NetworkThread::ReadReply(int src, int method, Message *reply) {
+  boost::mutex::scoped_lock sl(wait_lock_);
+  while (!check_reply_queue(src, method, reply)) {
+    arrived_[method].wait(sl);
   }
 }
 
+bool NetworkThread::TryReadReply(int src, int method, Message *reply) {
+  return check_reply_queue(src, method, reply);
+}
+
   // Enqueue the given request for transmission.
 void NetworkThread::Send(RPCRequest *req) {
-  boost::recursive_mutex::scoped_lock sl(send_lock);
+  {
+    boost::recursive_mutex::scoped_lock sl(send_lock);
 //    LOG(INFO) << "Sending... " << MP(req->target, req->rpc_type);
-  stats["bytes_sent"] += req->payload.size();
-  stats[StringPrintf("sends.%s", MessageTypes_Name((MessageTypes)(req->rpc_type)).c_str())] += 1;
-  pending_sends_.push_back(req);
+    stats["bytes_sent"] += req->payload.size();
+    stats[StringPrintf("sends.%s", MessageTypes_Name((MessageTypes)(req->rpc_type)).c_str())] += 1;
+    pending_sends_.push_back(req);
+  }
+
+  boost::mutex::scoped_lock wl(wait_lock_);
+  send_queued_.notify_one();
 }
 
 void NetworkThread::Send(int dst, int method, const Message &msg) {
@@ -334,18 +400,22 @@ void NetworkThread::WaitForSync(int method, int count) {
     pending.insert(i);
   }
 
-  while (!pending.empty()) {
+  boost::mutex::scoped_lock sl(wait_lock_);
+  while (true) {
     for (unordered_set<int>::iterator i = pending.begin();
-         i != pending.end();
-         ++i) {
+         i != pending.end();) {
       if (check_reply_queue(*i, method, NULL)) {
-        pending.erase(i);
+        i = pending.erase(i);
       } else {
         VLOG(2) << "Sync blocked on worker " << *i;
+        ++i;
       }
     }
+    if (pending.empty()) {
+      break;
+    }
     VLOG(2) << "Waiting for sync " << pending.size();
-    Sleep(FLAGS_sleep_time);
+    arrived_[method].wait(sl);
   }
 }
 
@@ -16,7 +16,7 @@ StringPiece::StringPiece(const string& s) : data(s.data()), len(s.size()) {}
 StringPiece::StringPiece(const string& s, int len) : data(s.data()), len(len) {}
 StringPiece::StringPiece(const char* c) : data(c), len(strlen(c)) {}
 StringPiece::StringPiece(const char* c, int len) : data(c), len(len) {}
-uint32_t StringPiece::hash() const { return SuperFastHash(data, len); }
+uint32_t StringPiece::hash() const { return HashBytes(data, len); }
 string StringPiece::AsString() const { return string(data, len); }
 
 void StringPiece::strip() {
@@ -16,9 +16,17 @@ using boost::unordered_set;
 
 DECLARE_double(sleep_time);
 DEFINE_double(sleep_hack, 0.0, "");
+DEFINE_int32(kernel_threads, 4,
+    "Kernels each worker runs at once, on different local shards.");
+DEFINE_int32(apply_threads, 2,
+    "Threads on each worker that apply updates sent to its shards.");
 
 namespace piccolo {
 
+// The longest the kernel loop waits for a message before checking for
+// tables to flush anyway.
+static const double kIdleWait = 0.1;
+
 struct Worker::Stub: private boost::noncopyable {
   int32_t id;
   int32_t epoch;
@@ -43,9 +51,17 @@ Worker::Worker(const ConfigData &c) {
 
   workerRunning_ = true;
   kernelRunning_ = false;
+  kernels_active_ = 0;
+  apply_pending_ = 0;
+  apply_done_ = 0;
   handlingPuts_ = false;
   iterator_id_ = 0;
 
+  TableRegistry::Map &tmap = TableRegistry::tables;
+  for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
+    i->second->setWorkerId(id());
+  }
+
   // Register RPC endpoints.
   rpc::RegisterCallback(MTYPE_GET, new HashGet, new TableData,
       &Worker::HandleGetRequest, this);
@@ -56,23 +72,17 @@ Worker::Worker(const ConfigData &c) {
   rpc::RegisterCallback(MTYPE_ITERATOR, new IteratorRequest,
       new IteratorResponse, &Worker::HandleIteratorRequest, this);
 
-  rpc::RegisterCallback(MTYPE_CLEAR_TABLE, new ClearTable, new EmptyMessage,
-      &Worker::HandleClearRequest, this);
-
-  rpc::RegisterCallback(MTYPE_SWAP_TABLE, new SwapTable, new EmptyMessage,
-      &Worker::HandleSwapRequest, this);
+  rpc::RegisterCallback(MTYPE_TABLE_CONTROL, new TableControl,
+      new EmptyMessage, &Worker::HandleTableControl, this);
 
   rpc::RegisterCallback(MTYPE_WORKER_FLUSH, new EmptyMessage, new FlushResponse,
       &Worker::HandleFlush, this);
 
-  rpc::RegisterCallback(MTYPE_WORKER_APPLY, new EmptyMessage, new EmptyMessage,
-      &Worker::HandleApply, this);
 
   rpc::RegisterCallback(MTYPE_WORKER_FINALIZE, new EmptyMessage,
       new EmptyMessage, &Worker::HandleFinalize, this);
 
   rpc::NetworkThread::Get()->SpawnThreadFor(MTYPE_WORKER_FLUSH);
-  rpc::NetworkThread::Get()->SpawnThreadFor(MTYPE_WORKER_APPLY);
 }
 
 int Worker::peer_for_shard(int table, int shard) const {
@@ -97,61 +107,148 @@ void Worker::KernelLoop() {
   req.set_id(id());
   network_->Send(0, MTYPE_REGISTER_WORKER, req);
 
-  KernelRequest kreq;
+  boost::thread_group pool;
+  for (int i = 0; i < FLAGS_kernel_threads; ++i) {
+    pool.create_thread(boost::bind(&Worker::KernelThread, this));
+  }
 
-  while (workerRunning_) {
-    Timer idle;
+  CHECK_GT(FLAGS_apply_threads, 0);
+  boost::thread_group appliers;
+  for (int i = 0; i < FLAGS_apply_threads; ++i) {
+    appliers.create_thread(boost::bind(&Worker::ApplyThread, this, i));
+  }
 
-    while (!network_->TryRead(config_.master_id(), MTYPE_RUN_KERNEL, &kreq)) {
+  KernelRequest kreq;
+  idle_.Reset();
+  while (workerRunning_) {
+    uint64_t seen = network_->arrivals();
+    if (!network_->TryRead(config_.master_id(), MTYPE_RUN_KERNEL, &kreq)) {
       CheckNetwork();
-      Sleep(FLAGS_sleep_time);
-
-      if (!workerRunning_) {
-        return;
-      }
-
+      network_->WaitForArrival(seen, kIdleWait);
+      continue;
     }
-    kernelRunning_ = true; //a kernel is running
-    stats_["idle_time"] += idle.elapsed();
 
     VLOG(1) << "Received run request for " << kreq;
-
     if (peer_for_shard(kreq.table(), kreq.shard()) != config_.worker_id()) {
       LOG(FATAL)<< "Received a shard I can't work on! : " << kreq.shard()
       << " : " << peer_for_shard(kreq.table(), kreq.shard());
     }
 
-    Kernel* k = KernelRegistry::create(kreq.kernelid());
+    if (kreq.epoch() != epoch_) {
+      // Data the master wrote before starting this run was sent ahead of
+      // the request; apply it first.
+      HandlePutRequest();
+      WaitForApply();
+    }
+
+    boost::mutex::scoped_lock sl(kernel_lock_);
+    if (kreq.epoch() != epoch_) {
+      // Remote values cached during the last run may since have changed.
+      epoch_ = kreq.epoch();
+      TableRegistry::Map &tables = TableRegistry::tables;
+      for (TableRegistry::Map::iterator i = tables.begin();
+          i != tables.end(); ++i) {
+        i->second->advanceEpoch();
+      }
+    }
 
-    if (this->id() == 1 && FLAGS_sleep_hack > 0) {
-      Sleep(FLAGS_sleep_hack);
+    if (kernels_active_ == 0 && kernel_queue_.empty()) {
+      stats_["idle_time"] += idle_.elapsed();
     }
+    kernel_queue_.push_back(kreq);
+    kernel_cond_.notify_one();
+  }
+
+  {
+    boost::mutex::scoped_lock sl(kernel_lock_);
+    kernel_cond_.notify_all();
+  }
+  pool.join_all();
+
+  {
+    boost::mutex::scoped_lock sl(apply_lock_);
+    apply_cond_.notify_all();
+  }
+  appliers.join_all();
+}
 
-    k->run(TableRegistry::table(kreq.table()), kreq.shard());
-
-    KernelDone kd;
-    kd.mutable_kernel()->CopyFrom(kreq);
-    TableRegistry::Map &tmap = TableRegistry::tables;
-    for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
-      ShardedTable* t = i->second;
-      for (int j = 0; j < t->numShards(); ++j) {
-        if (t->isLocalShard(j)) {
-          ShardInfo *si = kd.add_shards();
-          si->set_entries(t->shard(j)->size());
-          si->set_owner(this->id());
-          si->set_table(i->first);
-          si->set_shard(j);
-        }
+// Runs queued kernel requests, one at a time, until the worker shuts
+// down.  There are --kernel_threads of these.
+void Worker::KernelThread() {
+  KernelRequest kreq;
+  while (true) {
+    {
+      boost::mutex::scoped_lock sl(kernel_lock_);
+      while (kernel_queue_.empty() && workerRunning_) {
+        kernel_cond_.wait(sl);
+      }
+      if (kernel_queue_.empty()) {
+        return;
       }
+      kreq = kernel_queue_.front();
+      kernel_queue_.pop_front();
+      kernelRunning_ = true;
+      ++kernels_active_;
     }
-    kernelRunning_ = false;
-    network_->Send(config_.master_id(), MTYPE_KERNEL_DONE, kd);
 
-    VLOG(1) << "Kernel finished: " << kreq;
-    DumpProfile();
+    RunKernel(kreq);
+
+    boost::mutex::scoped_lock sl(kernel_lock_);
+    kernelRunning_ = --kernels_active_ > 0;
+    if (!kernelRunning_ && kernel_queue_.empty()) {
+      idle_.Reset();
+    }
   }
 }
 
+void Worker::RunKernel(const KernelRequest& kreq) {
+  Kernel* k = KernelRegistry::create(kreq.kernelid());
+
+  if (this->id() == 1 && FLAGS_sleep_hack > 0) {
+    Sleep(FLAGS_sleep_hack);
+  }
+
+  // Keep the apply threads off the shard while the kernel runs on it.
+  ShardQueue* q;
+  {
+    boost::mutex::scoped_lock sl(apply_lock_);
+    q = &apply_queues_[ShardId(kreq.table(), kreq.shard())];
+    while (q->applying) {
+      apply_cond_.wait(sl);
+    }
+    q->kernel = true;
+  }
+
+  k->run(TableRegistry::table(kreq.table()), kreq.shard());
+  delete k;
+
+  {
+    boost::mutex::scoped_lock sl(apply_lock_);
+    q->kernel = false;
+    apply_cond_.notify_all();
+  }
+
+  KernelDone kd;
+  kd.mutable_kernel()->CopyFrom(kreq);
+  TableRegistry::Map &tmap = TableRegistry::tables;
+  for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
+    ShardedTable* t = i->second;
+    for (int j = 0; j < t->numShards(); ++j) {
+      if (t->isLocalShard(j)) {
+        ShardInfo *si = kd.add_shards();
+        si->set_entries(t->shard(j)->size());
+        si->set_owner(this->id());
+        si->set_table(i->first);
+        si->set_shard(j);
+      }
+    }
+  }
+  network_->Send(config_.master_id(), MTYPE_KERNEL_DONE, kd);
+
+  VLOG(1) << "Kernel finished: " << kreq;
+  DumpProfile();
+}
+
 void Worker::CheckNetwork() {
   Timer net;
   CheckForMasterUpdates();
@@ -160,7 +257,7 @@ void Worker::CheckNetwork() {
   // Flush any tables we no longer own.
   for (unordered_set<ShardedTable*>::iterator i = dirty_tables_.begin();
       i != dirty_tables_.end(); ++i) {
-    ShardedTable *t = dynamic_cast<ShardedTable*>(*i);
+    (*i)->flush();
   }
 
   dirty_tables_.clear();
@@ -190,19 +287,108 @@ void Worker::HandlePutRequest() {
   boost::recursive_try_mutex::scoped_lock sl(state_lock_);
   handlingPuts_ = true;
 
-  TableData put;
-  while (network_->TryRead(rpc::ANY_SOURCE, MTYPE_PUT_REQUEST, &put)) {
-    VLOG(2) << "Read put request of size: " << put.kv_data_size() << " for "
-               << MP(put.table(), put.shard());
+  TableData* put = new TableData;
+  while (network_->TryRead(rpc::ANY_SOURCE, MTYPE_PUT_REQUEST, put)) {
+    VLOG(2) << "Read put request of size: " << put->kv_data_size() << " for "
+               << MP(put->table(), put->shard());
+
+    ShardedTable *t = TableRegistry::table(put->table());
+    if (!t->isLocalShard(put->shard())) {
+      // The shard moved while this request was in flight; pass it on.
+      RemoteTable::countSent();
+      network_->Send(t->workerForShard(put->shard()) + 1, MTYPE_PUT_REQUEST,
+          *put);
+      boost::mutex::scoped_lock al(apply_lock_);
+      ++apply_done_;
+      continue;
+    }
 
-    ShardedTable *t = TableRegistry::table(put.table());
-    //t->applyUpdates(put);
-    LOG(FATAL)<< "TODO";
+    boost::mutex::scoped_lock al(apply_lock_);
+    apply_queues_[ShardId(put->table(), put->shard())].batches.push_back(put);
+    ++apply_pending_;
+    apply_cond_.notify_all();
+    put = new TableData;
   }
+  delete put;
 
   handlingPuts_ = false;
 }
 
+// Applies the queued batches of the shards whose (table, shard) hashes to
+// 'index', so that each shard's batches are applied in order and the
+// threads never contend for a shard.  A shard being mapped is passed over
+// until the map ends, rather than stalling the thread's other shards.
+void Worker::ApplyThread(int index) {
+  boost::mutex::scoped_lock sl(apply_lock_);
+  while (true) {
+    ShardQueue* q = NULL;
+    for (std::map<ShardId, ShardQueue>::iterator i = apply_queues_.begin();
+        i != apply_queues_.end(); ++i) {
+      const ShardId& id = i->first;
+      if ((id.first * 7919 + id.second) % FLAGS_apply_threads != index ||
+          i->second.batches.empty() || i->second.kernel) {
+        continue;
+      }
+      ShardMutex* lock = TableRegistry::table(id.first)->shardLock(id.second);
+      if (lock == NULL || !lock->mapped()) {
+        q = &i->second;
+        break;
+      }
+    }
+
+    if (q == NULL) {
+      if (!workerRunning_) {
+        return;
+      }
+      apply_cond_.wait(sl);
+      continue;
+    }
+
+    TableData* put = q->batches.front();
+    q->batches.pop_front();
+    q->applying = true;
+    sl.unlock();
+
+    ApplyPut(put);
+    delete put;
+
+    sl.lock();
+    q->applying = false;
+    --apply_pending_;
+    ++apply_done_;
+    apply_cond_.notify_all();
+  }
+}
+
+void Worker::ApplyPut(TableData* put) {
+  ShardedTable *t = TableRegistry::table(put->table());
+  if (!t->isLocalShard(put->shard())) {
+    RemoteTable::countSent();
+    network_->Send(t->workerForShard(put->shard()) + 1, MTYPE_PUT_REQUEST,
+        *put);
+    return;
+  }
+
+  ShardLock sl(t->shardLock(put->shard()), true);
+  Table *shard = t->shard(put->shard());
+  ProtoTableCoder coder(put);
+  if (put->overwrite()) {
+    string k, v;
+    while (coder.read(&k, &v)) {
+      shard->putStr(k, v);
+    }
+  } else {
+    shard->applyUpdates(&coder);
+  }
+}
+
+void Worker::WaitForApply() {
+  boost::mutex::scoped_lock sl(apply_lock_);
+  while (apply_pending_ > 0) {
+    apply_cond_.wait(sl);
+  }
+}
+
 void Worker::HandleGetRequest(const HashGet& get_req, TableData *get_resp,
                               const rpc::RPCInfo& rpc) {
 //    LOG(INFO) << "Get request: " << get_req;
@@ -213,9 +399,31 @@ void Worker::HandleGetRequest(const HashGet& get_req, TableData *get_resp,
   get_resp->set_shard(-1);
   get_resp->set_done(true);
   get_resp->set_epoch(epoch_);
+  get_resp->set_index(get_req.index());
+
+  if (get_req.keys_size() > 0) {
+    ShardedTable * t = TableRegistry::table(get_req.table());
+    for (int i = 0; i < get_req.keys_size(); ++i) {
+      const string& key = get_req.keys(i);
+      int shard = get_req.shards(i);
+      if (!t->isLocalShard(shard)) {
+        continue;
+      }
+      ShardLock sl(t->shardLock(shard));
+      if (t->shard(shard)->containsStr(key)) {
+        Arg* kv = get_resp->add_kv_data();
+        kv->set_key(key);
+        kv->set_value(t->shard(shard)->getStr(key));
+      }
+    }
+    VLOG(2) << "Returning " << get_resp->kv_data_size() << " of "
+               << get_req.keys_size() << " keys for table " << get_req.table();
+    return;
+  }
 
   {
     ShardedTable * t = TableRegistry::table(get_req.table());
+    ShardLock sl(t->shardLock(get_req.shard()));
     Table* shard = t->shard(get_req.shard());
     if (shard->containsStr(get_req.key())) {
       get_resp->set_missing_key(false);
@@ -231,22 +439,28 @@ void Worker::HandleGetRequest(const HashGet& get_req, TableData *get_resp,
              << " - found? " << !get_resp->missing_key();
 }
 
-void Worker::HandleSwapRequest(const SwapTable& req, EmptyMessage *resp,
-                               const rpc::RPCInfo& rpc) {
-  ShardedTable *ta = TableRegistry::table(req.table_a());
-  ShardedTable *tb = TableRegistry::table(req.table_b());
-
-  // ta->swapLocal(tb);
-  LOG(FATAL)<< "TODO";
-}
-
-void Worker::HandleClearRequest(const ClearTable& req, EmptyMessage *resp,
+// Sent by the master between runs.  Updates that reached this worker
+// before the request are applied first, so they land in the table they
+// were written to.
+void Worker::HandleTableControl(const TableControl& req, EmptyMessage *resp,
                                 const rpc::RPCInfo& rpc) {
-  ShardedTable *ta = TableRegistry::table(req.table());
-
-  for (int i = 0; i < ta->numShards(); ++i) {
-    if (ta->isLocalShard(i)) {
-      ta->shard(i)->clear();
+  boost::recursive_mutex::scoped_lock sl(state_lock_);
+  HandlePutRequest();
+  WaitForApply();
+
+  for (int i = 0; i < req.op_size(); ++i) {
+    const TableControl::Op& op = req.op(i);
+    Table* t = dynamic_cast<Table*>(TableRegistry::table(op.table()));
+    switch (op.type()) {
+    case TableControl::CLEAR:
+      t->clear();
+      break;
+    case TableControl::SWAP:
+      t->swap(dynamic_cast<Table*>(TableRegistry::table(op.other())));
+      break;
+    case TableControl::RESERVE:
+      t->reserve(op.entries());
+      break;
     }
   }
 }
@@ -257,17 +471,30 @@ void Worker::HandleIteratorRequest(const IteratorRequest& iterator_req,
   int table = iterator_req.table();
   int shard = iterator_req.shard();
 
+  // The shard is read in place, a page at a time under its lock.  Kernels
+  // and apply threads may change it between pages, so an entry written
+  // while the iterator is open may be returned twice or not at all.
   ShardedTable * t = TableRegistry::table(table);
+  ShardLock sl(t->shardLock(shard));
   TableIterator* it = NULL;
   if (iterator_req.id() == -1) {
     it = t->shard(shard)->iterator();
     uint32_t id = iterator_id_++;
     iterators_[id] = it;
     iterator_resp->set_id(id);
+    iterator_resp->set_tag(iterator_req.tag());
   } else {
-    it = iterators_[iterator_req.id()];
     iterator_resp->set_id(iterator_req.id());
-    CHECK_NE(it, (void *)NULL);
+    iterator_resp->clear_tag();
+    if (iterators_.find(iterator_req.id()) == iterators_.end()) {
+      // A prefetch that arrived after the iterator finished.
+      iterator_resp->set_done(true);
+      iterator_resp->set_row_count(0);
+      iterator_resp->clear_key();
+      iterator_resp->clear_value();
+      return;
+    }
+    it = iterators_[iterator_req.id()];
     it->Next();
   }
 
@@ -287,6 +514,11 @@ void Worker::HandleIteratorRequest(const IteratorRequest& iterator_req,
     } else
       break;
   }
+  if (it->done()) {
+    iterators_.erase(iterator_resp->id());
+    delete it;
+  }
+
   VLOG(2) << "[PREFETCH] Returning " << iterator_resp->row_count()
              << " rows in response to request for " << iterator_req.row_count()
              << " rows in table " << table << ", shard " << shard;
@@ -296,11 +528,12 @@ void Worker::HandleShardAssignment(const ShardAssignmentRequest& shard_req,
                                    EmptyMessage *resp,
                                    const rpc::RPCInfo& rpc) {
 //  LOG(INFO) << "Shard assignment: " << shard_req.DebugString();
+  boost::recursive_mutex::scoped_lock sl(state_lock_);
   for (int i = 0; i < shard_req.assign_size(); ++i) {
     const ShardAssignment &a = shard_req.assign(i);
     ShardedTable *t = TableRegistry::table(a.table());
     int old_workerForShard = t->workerForShard(a.shard());
-    t->shardInfo(a.shard())->set_owner(a.new_worker());
+    t->assignShard(a.shard(), a.new_worker());
 
     VLOG(3) << "Setting workerForShard: " << MP(a.shard(), a.new_worker());
 
@@ -327,32 +560,49 @@ void Worker::HandleShardAssignment(const ShardAssignmentRequest& shard_req,
   }
 }
 
+// One wave of the master's termination detection.  The request travels
+// down a binary tree of workers, worker i passing it to workers 2i + 1 and
+// 2i + 2, and the reply to the parent carries the totals of the subtree.
 void Worker::HandleFlush(const EmptyMessage& req, FlushResponse *resp,
                          const rpc::RPCInfo& rpc) {
   Timer net;
 
-  TableRegistry::Map &tmap = TableRegistry::tables;
+  std::vector<int> children;
+  for (int c = 2 * id() + 1; c <= 2 * id() + 2 && c < num_peers_; ++c) {
+    children.push_back(c);
+    network_->Send(c + 1, MTYPE_WORKER_FLUSH, req);
+  }
 
+  TableRegistry::Map &tmap = TableRegistry::tables;
+  int64_t flushed = 0;
   for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
-    ShardedTable* t = dynamic_cast<ShardedTable*>(i->second);
-    if (t) {
-      VLOG(2) << "Doing flush for table " << i->second;
-      LOG(FATAL)<< "TODO - send updates";
-    }
+    VLOG(2) << "Doing flush for table " << i->second;
+    flushed += i->second->flush();
   }
-  network_->Flush();
 
-  network_->Send(config_.master_id(), MTYPE_FLUSH_RESPONSE, *resp);
+  // Settle what has arrived so far, so a later wave is likely to balance.
+  HandlePutRequest();
+  WaitForApply();
 
-  network_->Flush();
-  stats_["network_time"] += net.elapsed();
-}
+  int64_t sent = RemoteTable::batchesSent();
+  int64_t applied;
+  {
+    boost::mutex::scoped_lock sl(apply_lock_);
+    applied = apply_done_;
+  }
 
-void Worker::HandleApply(const EmptyMessage& req, EmptyMessage *resp,
-                         const rpc::RPCInfo& rpc) {
-  HandlePutRequest();
+  FlushResponse child;
+  for (size_t i = 0; i < children.size(); ++i) {
+    network_->ReadReply(children[i] + 1, MTYPE_WORKER_FLUSH, &child);
+    flushed += child.updatesdone();
+    sent += child.sent();
+    applied += child.applied();
+  }
 
-  network_->Send(config_.master_id(), MTYPE_WORKER_APPLY_DONE, *resp);
+  resp->set_updatesdone(flushed);
+  resp->set_sent(sent);
+  resp->set_applied(applied);
+  stats_["network_time"] += net.elapsed();
 }
 
 void Worker::HandleFinalize(const EmptyMessage& req, EmptyMessage *resp,